@@ -26,6 +26,8 @@ static void bad_change_state(const struct dc_posix_env *env,
                          int from_state_id,
                          int to_state_id);
 static int process(const struct dc_posix_env *env, struct dc_error *err, void *arg);
+static bool is_upper(const struct dc_posix_env *env, struct dc_error *err, void *arg);
+static bool is_lower(const struct dc_posix_env *env, struct dc_error *err, void *arg);
 static int upper(const struct dc_posix_env *env, struct dc_error *err, void *arg);
 static int lower(const struct dc_posix_env *env, struct dc_error *err, void *arg);
 static int nothing(const struct dc_posix_env *env, struct dc_error *err, void *arg);
@@ -50,12 +52,18 @@ int main(int argc, char *argv[])
     struct dc_fsm_info *fsm_info;
     static struct dc_fsm_transition transitions[] = {
             {DC_FSM_INIT, PROCESS,     process},
-            {PROCESS,     UPPER, upper},
-            {PROCESS,     LOWER, lower},
-            {PROCESS,     NOTHING, nothing},
+            {PROCESS,     UPPER,       upper},
+            {PROCESS,     LOWER,       lower},
+            {PROCESS,     NOTHING,     nothing},
             {UPPER,       DC_FSM_EXIT, NULL},
             {LOWER,       DC_FSM_EXIT, NULL},
             {NOTHING,     DC_FSM_EXIT, NULL},
+            {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
+    };
+    static const struct dc_fsm_guard guards[] = {
+            {PROCESS,     UPPER,       is_upper},
+            {PROCESS,     LOWER,       is_lower},
+            {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
     };
 
     dc_error_init(&err, error_reporter);
@@ -65,6 +73,7 @@ int main(int argc, char *argv[])
 //    dc_fsm_info_set_will_change_state(fsm_info, will_change_state);
 //    dc_fsm_info_set_did_change_state(fsm_info, did_change_state);
     dc_fsm_info_set_bad_change_state(fsm_info, bad_change_state);
+    dc_fsm_info_set_guards(&env, &err, fsm_info, guards);
 
     if(dc_error_has_no_error(&err))
     {
@@ -118,28 +127,27 @@ static void bad_change_state(const struct dc_posix_env *env,
 }
 
 static int process(const struct dc_posix_env *env, struct dc_error *err, void *arg)
+{
+	// the guards on the transitions out of PROCESS pick the next state
+	return DC_FSM_ROUTE;
+}
+
+static bool is_upper(const struct dc_posix_env *env, struct dc_error *err, void *arg)
 {
 	const char *str;
-	char c;
-	int next_state;
 
 	str = (const char *)arg;
-	c = str[0];
 
-	if(isupper(c))
-	{
-		next_state = UPPER;
-	}	
-	else if(islower(c))
-	{
-		next_state = LOWER;
-	}	
-	else
-	{
-		next_state = NOTHING;
-	}	
+	return isupper(str[0]);
+}
+
+static bool is_lower(const struct dc_posix_env *env, struct dc_error *err, void *arg)
+{
+	const char *str;
+
+	str = (const char *)arg;
 
-	return next_state;
+	return islower(str[0]);
 }
 
 static int upper(const struct dc_posix_env *env, struct dc_error *err, void *arg)
@@ -0,0 +1,119 @@
+#ifndef LIBDC_FSM_ASYNC_H
+#define LIBDC_FSM_ASYNC_H
+
+
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "fsm.h"
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct dc_fsm_async;
+
+typedef enum {
+  DC_FSM_ASYNC_DROP,  // 0 - drop the event when the buffer is full
+  DC_FSM_ASYNC_BLOCK, // 1 - wait for the consumer when the buffer is full
+} dc_fsm_async_policy;
+
+/**
+ * enqueued counts every event handed to the dc_fsm_async, and once it has
+ * been flushed each of them has been either delivered or dropped.
+ */
+struct dc_fsm_async_stats {
+  size_t enqueued;
+  size_t delivered;
+  size_t dropped;
+  size_t blocked;
+  size_t batches;
+};
+
+/**
+ * Start a background thread that delivers the notifications of every
+ * dc_fsm_info attached to it. The notifiers are only ever called on that
+ * thread, with env and notifier_err, and without any lock held, so they may
+ * call the other functions here (but not dc_fsm_async_destroy). A notifier
+ * that detaches or destroys its own dc_fsm_info discards the events still
+ * buffered for it, which are counted as dropped.
+ *
+ * @param env
+ * @param err
+ * @param notifier_err the error passed to notifiers on the background thread
+ * @param capacity the number of events each attached dc_fsm_info can buffer
+ * @param policy what to do when a buffer is full
+ * @return
+ */
+struct dc_fsm_async *dc_fsm_async_create(const struct dc_env *env,
+                                         struct dc_error *err,
+                                         struct dc_error *notifier_err,
+                                         size_t capacity,
+                                         dc_fsm_async_policy policy);
+
+/**
+ * Deliver any buffered events, stop the background thread, and detach every
+ * dc_fsm_info that is still attached.
+ *
+ * @param env
+ * @param pasync
+ */
+void dc_fsm_async_destroy(const struct dc_env *env,
+                          struct dc_fsm_async **pasync);
+
+/**
+ * Wait until the background thread has delivered every buffered event.
+ *
+ * @param env
+ * @param async
+ */
+void dc_fsm_async_flush(const struct dc_env *env, struct dc_fsm_async *async);
+
+/**
+ *
+ * @param async
+ * @param stats
+ */
+void dc_fsm_async_get_stats(struct dc_fsm_async *async,
+                            struct dc_fsm_async_stats *stats);
+
+/**
+ * Send the notifications of info through async instead of calling them from
+ * dc_fsm_run. Each info gets its own lock-free buffer, so only one thread may
+ * run info at a time. Passing a NULL async waits for anything still buffered
+ * to be delivered and goes back to calling the notifiers directly.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param async
+ * @return 0 on success, -1 if the buffer could not be created
+ */
+int dc_fsm_info_set_async(const struct dc_env *env, struct dc_error *err,
+                          struct dc_fsm_info *info,
+                          struct dc_fsm_async *async);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif // LIBDC_FSM_ASYNC_H
@@ -0,0 +1,154 @@
+#ifndef LIBDC_FSM_DFA_H
+#define LIBDC_FSM_DFA_H
+
+
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "fsm.h"
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct dc_fsm_dfa;
+
+/**
+ * Bytes that do not fall in any declared class belong to this class.
+ */
+#define DC_FSM_DFA_CLASS_OTHER 0
+
+/**
+ * The maximum number of distinct states (including DC_FSM_EXIT) in a DFA.
+ */
+#define DC_FSM_DFA_MAX_STATES 256
+
+/**
+ * Maps the bytes first..last (inclusive) to class_id. A class_id of
+ * DC_FSM_IGNORE ends the list.
+ */
+struct dc_fsm_dfa_class {
+  unsigned char first;
+  unsigned char last;
+  int class_id;
+};
+
+/**
+ * Moves from from_id to to_id when a byte of class_id is read. If perform is
+ * not NULL the byte is an action and perform is called with a
+ * struct dc_fsm_dfa_event as its arg. A from_id of DC_FSM_IGNORE ends the
+ * list.
+ */
+struct dc_fsm_dfa_transition {
+  int from_id;
+  int class_id;
+  int to_id;
+  dc_fsm_state_func perform;
+};
+
+/**
+ * Passed as the arg to the perform function of an action transition. perform
+ * returns the state to continue in: to_id (or DC_FSM_IGNORE) to follow the
+ * transition, DC_FSM_EXIT to stop scanning, or any other known state.
+ */
+struct dc_fsm_dfa_event {
+  const unsigned char *data;
+  size_t length;
+  size_t offset;
+  int from_id;
+  int to_id;
+  void *arg;
+};
+
+/**
+ *
+ * @param env
+ * @param err
+ * @param classes
+ * @param transitions
+ * @return
+ */
+struct dc_fsm_dfa *
+dc_fsm_dfa_create(const struct dc_env *env, struct dc_error *err,
+                  const struct dc_fsm_dfa_class classes[],
+                  const struct dc_fsm_dfa_transition transitions[]);
+
+/**
+ *
+ * @param env
+ * @param pdfa
+ */
+void dc_fsm_dfa_destroy(const struct dc_env *env, struct dc_fsm_dfa **pdfa);
+
+/**
+ * Scan length bytes of data starting in the current state of info. Only
+ * action transitions call perform and the info notifiers. The final state is
+ * kept in info so a stream can be scanned one buffer at a time.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param dfa
+ * @param data
+ * @param length
+ * @param consumed the number of bytes read, less than length on DC_FSM_EXIT or an error
+ * @param arg
+ * @return 0 on success, -1 on an unknown transition
+ */
+int dc_fsm_dfa_run(const struct dc_env *env, struct dc_error *err,
+                   struct dc_fsm_info *info, const struct dc_fsm_dfa *dfa,
+                   const void *data, size_t length, size_t *consumed,
+                   void *arg);
+
+/**
+ * Scan data the same way as dc_fsm_dfa_run, but split it into chunks and work
+ * out where every start state ends up in each chunk on its own thread, noting
+ * the actions met on the way as if every perform returned its to_id. The
+ * chunks are then stitched together in order on the calling thread, which
+ * runs the noted actions and only rescans a chunk from where a perform goes
+ * somewhere else or the chunk met more actions than it had room to note, so
+ * the actions, notifiers, and final state are exactly those of
+ * dc_fsm_dfa_run. This pays off for machines with few states and no more than
+ * about one action every 16 bytes.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param dfa
+ * @param data
+ * @param length
+ * @param thread_count the most threads to use, including the calling thread
+ * @param consumed the number of bytes read, less than length on DC_FSM_EXIT or an error
+ * @param arg
+ * @return 0 on success, -1 on an unknown transition
+ */
+int dc_fsm_dfa_run_parallel(const struct dc_env *env, struct dc_error *err,
+                            struct dc_fsm_info *info,
+                            const struct dc_fsm_dfa *dfa, const void *data,
+                            size_t length, size_t thread_count,
+                            size_t *consumed, void *arg);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif // LIBDC_FSM_DFA_H
@@ -20,6 +20,8 @@
 
 
 #include <dc_env/env.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 
 #ifdef __cplusplus
@@ -30,6 +32,7 @@ extern "C" {
 struct dc_fsm_info;
 
 typedef enum {
+  DC_FSM_ROUTE = -2,  // -2
   DC_FSM_IGNORE = -1, // -1
   DC_FSM_INIT,        // 0
   DC_FSM_EXIT,        // 1
@@ -39,12 +42,34 @@ typedef enum {
 typedef int (*dc_fsm_state_func)(const struct dc_env *env,
                                  struct dc_error *err, void *arg);
 
+typedef bool (*dc_fsm_guard_func)(const struct dc_env *env,
+                                  struct dc_error *err, void *arg);
+
 struct dc_fsm_transition {
   int from_id;
   int to_id;
   dc_fsm_state_func perform;
 };
 
+/**
+ * When the state function for from_id returns DC_FSM_ROUTE the engine picks
+ * the next state itself: the first guard out of from_id that returns true,
+ * or failing that the first transition out of from_id without a guard. Each
+ * guard is called at most once per routing step.
+ */
+struct dc_fsm_guard {
+  int from_id;
+  int to_id;
+  dc_fsm_guard_func guard;
+};
+
+struct dc_fsm_guard_stats {
+  dc_fsm_guard_func guard;
+  size_t evaluations;
+  size_t passes;
+  size_t cache_hits;
+};
+
 /**
  *
  * @param env
@@ -103,6 +128,45 @@ void dc_fsm_info_set_bad_change_state(
                      const struct dc_fsm_info *info, int from_state_id,
                      int to_state_id));
 
+/**
+ * Set the guards that route out of states returning DC_FSM_ROUTE, in the
+ * order they are tried. The table ends with an entry whose from_id is
+ * DC_FSM_IGNORE and has to stay valid while info uses it. Setting the guards
+ * resets the guard stats.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param guards the guard table, or NULL to remove the guards
+ * @return 0 on success, -1 on failure
+ */
+int dc_fsm_info_set_guards(const struct dc_env *env, struct dc_error *err,
+                           struct dc_fsm_info *info,
+                           const struct dc_fsm_guard guards[]);
+
+/**
+ * Evaluate guards in order of how often they have passed instead of in
+ * declaration order. Only turn this on when at most one guard out of a state
+ * can pass at a time.
+ *
+ * @param info
+ * @param order_by_selectivity
+ */
+void dc_fsm_info_set_guard_ordering(struct dc_fsm_info *info,
+                                    bool order_by_selectivity);
+
+/**
+ *
+ * @param info
+ * @param stats
+ * @param max_stats
+ * @return the number of distinct guard functions set on info, which may be
+ * more than max_stats
+ */
+size_t dc_fsm_info_get_guard_stats(const struct dc_fsm_info *info,
+                                   struct dc_fsm_guard_stats stats[],
+                                   size_t max_stats);
+
 /**
  *
  * @param env
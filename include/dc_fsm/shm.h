@@ -0,0 +1,152 @@
+#ifndef LIBDC_FSM_SHM_H
+#define LIBDC_FSM_SHM_H
+
+
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "fsm.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct dc_fsm_shm;
+
+/**
+ * The longest machine name kept in a slot, including the terminating '\0'.
+ */
+#define DC_FSM_SHM_NAME_LENGTH 48
+
+/**
+ * A copy of one slot taken by dc_fsm_shm_snapshot. transitions counts the
+ * state functions the machine has run.
+ */
+struct dc_fsm_shm_entry {
+  size_t slot;
+  pid_t owner;
+  int from_state_id;
+  int current_state_id;
+  uint64_t transitions;
+  char name[DC_FSM_SHM_NAME_LENGTH];
+};
+
+/**
+ * Open the POSIX shared memory segment called path, creating it with
+ * slot_count slots if it does not exist yet. Every process that opens the
+ * same path sees the same slots.
+ *
+ * @param env
+ * @param err
+ * @param path the shm_open name, for example "/dc_fsm"
+ * @param slot_count the number of slots when the segment is created
+ * @return
+ */
+struct dc_fsm_shm *dc_fsm_shm_open(const struct dc_env *env,
+                                   struct dc_error *err, const char *path,
+                                   size_t slot_count);
+
+/**
+ * Unmap the segment. Any dc_fsm_info still attached to it must be detached
+ * first.
+ *
+ * @param env
+ * @param pshm
+ */
+void dc_fsm_shm_close(const struct dc_env *env, struct dc_fsm_shm **pshm);
+
+/**
+ *
+ * @param env
+ * @param err
+ * @param path
+ * @return 0 on success, -1 on failure
+ */
+int dc_fsm_shm_unlink(const struct dc_env *env, struct dc_error *err,
+                      const char *path);
+
+/**
+ *
+ * @param shm
+ * @return
+ */
+size_t dc_fsm_shm_get_slot_count(const struct dc_fsm_shm *shm);
+
+/**
+ * Copy every slot that is in use, in one pass, without locking out the
+ * machines that own them. A slot that is claimed or freed while it is being
+ * copied is read again, and left out if it keeps changing.
+ *
+ * @param shm
+ * @param entries
+ * @param max_entries
+ * @return the number of entries filled in
+ */
+size_t dc_fsm_shm_snapshot(const struct dc_fsm_shm *shm,
+                           struct dc_fsm_shm_entry entries[],
+                           size_t max_entries);
+
+/**
+ * Claim a free slot and keep the state of info in it from now on.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param shm
+ * @return the slot index, or -1 if there is no free slot
+ */
+ssize_t dc_fsm_info_attach_shm(const struct dc_env *env, struct dc_error *err,
+                               struct dc_fsm_info *info,
+                               struct dc_fsm_shm *shm);
+
+/**
+ * Take over a slot whose owning process has exited. info continues from the
+ * state and counters left in the slot, unless the process exited before it
+ * finished claiming the slot.
+ *
+ * @param env
+ * @param err
+ * @param info
+ * @param shm
+ * @param slot
+ * @return 0 on success, -1 if the slot is owned by a live process
+ */
+int dc_fsm_info_adopt_shm(const struct dc_env *env, struct dc_error *err,
+                          struct dc_fsm_info *info, struct dc_fsm_shm *shm,
+                          size_t slot);
+
+/**
+ * Copy the state back into info and free its slot.
+ *
+ * @param env
+ * @param info
+ */
+void dc_fsm_info_detach_shm(const struct dc_env *env,
+                            struct dc_fsm_info *info);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif // LIBDC_FSM_SHM_H
@@ -0,0 +1,572 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dc_fsm/async.h"
+#include "fsm_internal.h"
+#include <dc_c/dc_stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+
+#define ASYNC_MIN_CAPACITY 2
+#define ASYNC_BATCH_SIZE 64
+#define ASYNC_IDLE_NSEC 1000000L
+#define ASYNC_CACHE_LINE 64
+#define NSEC_PER_SEC 1000000000L
+
+
+struct fsm_async_event
+{
+    enum fsm_notification kind;
+    int                   from_state_id;
+    int                   to_state_id;
+    int                   next_id;
+};
+
+// single producer (the thread running the machine), single consumer (the background thread)
+struct fsm_async_ring
+{
+    struct fsm_async_ring *next;
+    struct dc_fsm_info    *info;
+    struct dc_fsm_async   *async;
+    size_t                 mask;
+    bool                   busy;
+    bool                   orphaned;
+    bool                   draining;
+
+    _Alignas(ASYNC_CACHE_LINE) atomic_size_t tail;
+    atomic_size_t                            enqueued;
+    atomic_size_t                            dropped;
+    atomic_size_t                            blocked;
+
+    _Alignas(ASYNC_CACHE_LINE) atomic_size_t head;
+
+    struct fsm_async_event events[];
+};
+
+struct dc_fsm_async
+{
+    const struct dc_env      *env;
+    struct dc_error          *notifier_err;
+    size_t                    capacity;
+    dc_fsm_async_policy       policy;
+    pthread_mutex_t           mutex;
+    pthread_cond_t            wake;
+    pthread_cond_t            idle;
+    pthread_t                 thread;
+    bool                      stopping;
+    bool                      stopped;
+    struct fsm_async_ring    *rings;
+    struct dc_fsm_async_stats retired;
+    size_t                    delivered;
+    size_t                    batches;
+};
+
+static void *async_consume(void *arg);
+static struct fsm_async_ring *
+async_deliver_batch(struct dc_fsm_async *async, struct fsm_async_ring *ring, size_t *count);
+static bool async_is_pending(const struct fsm_async_ring *ring);
+static bool async_is_flushed(const struct dc_fsm_async *async);
+static bool async_is_consumer(const struct dc_fsm_async *async);
+static void async_deliver(struct dc_fsm_async *async, struct dc_fsm_info *info, const struct fsm_async_event *event);
+
+struct dc_fsm_async *dc_fsm_async_create(const struct dc_env *env,
+                                         struct dc_error     *err,
+                                         struct dc_error     *notifier_err,
+                                         size_t               capacity,
+                                         dc_fsm_async_policy  policy)
+{
+    struct dc_fsm_async *async;
+    int                  result;
+
+    DC_TRACE(env);
+    async = dc_calloc(env, err, 1, sizeof(struct dc_fsm_async));
+
+    if(dc_error_has_error(err))
+    {
+        return NULL;
+    }
+
+    // a power of two lets the ring wrap with a mask
+    async->capacity = ASYNC_MIN_CAPACITY;
+
+    while(async->capacity < capacity)
+    {
+        async->capacity <<= 1U;
+    }
+
+    async->env          = env;
+    async->notifier_err = notifier_err;
+    async->policy       = policy;
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->wake, NULL);
+    pthread_cond_init(&async->idle, NULL);
+    result = pthread_create(&async->thread, NULL, async_consume, async);
+
+    if(result != 0)
+    {
+        DC_ERROR_RAISE_ERRNO(err, result);
+        pthread_cond_destroy(&async->idle);
+        pthread_cond_destroy(&async->wake);
+        pthread_mutex_destroy(&async->mutex);
+        dc_free(env, async);
+        async = NULL;
+    }
+
+    return async;
+}
+
+void dc_fsm_async_destroy(const struct dc_env *env, struct dc_fsm_async **pasync)
+{
+    struct dc_fsm_async *async;
+
+    DC_TRACE(env);
+    async = *pasync;
+    pthread_mutex_lock(&async->mutex);
+    async->stopping = true;
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->mutex);
+    pthread_join(async->thread, NULL);
+
+    // anything queued from here on has no one to deliver it, so detaching counts it as dropped
+    pthread_mutex_lock(&async->mutex);
+    async->stopped = true;
+    pthread_cond_broadcast(&async->idle);
+    pthread_mutex_unlock(&async->mutex);
+
+    while(async->rings)
+    {
+        fsm_async_detach(env, async->rings->info);
+    }
+
+    pthread_cond_destroy(&async->idle);
+    pthread_cond_destroy(&async->wake);
+    pthread_mutex_destroy(&async->mutex);
+    dc_free(env, async);
+    *pasync = NULL;
+}
+
+void dc_fsm_async_flush(const struct dc_env *env, struct dc_fsm_async *async)
+{
+    DC_TRACE(env);
+    pthread_mutex_lock(&async->mutex);
+
+    if(async_is_consumer(async))
+    {
+        struct fsm_async_ring *ring;
+
+        // called from a notifier; the rings being delivered by outer calls are left to them, or their events would
+        // be reordered
+        do
+        {
+            size_t count;
+
+            count = 0;
+            ring  = async->rings;
+
+            while(ring && (ring->busy || !async_is_pending(ring)))
+            {
+                ring = ring->next;
+            }
+
+            if(ring)
+            {
+                async_deliver_batch(async, ring, &count);
+            }
+        } while(ring);
+    }
+    else
+    {
+        while(!async->stopped && !async_is_flushed(async))
+        {
+            pthread_cond_signal(&async->wake);
+            pthread_cond_wait(&async->idle, &async->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+}
+
+void dc_fsm_async_get_stats(struct dc_fsm_async *async, struct dc_fsm_async_stats *stats)
+{
+    pthread_mutex_lock(&async->mutex);
+    *stats           = async->retired;
+    stats->delivered = async->delivered;
+    stats->batches   = async->batches;
+
+    for(struct fsm_async_ring *ring = async->rings; ring; ring = ring->next)
+    {
+        stats->enqueued += atomic_load_explicit(&ring->enqueued, memory_order_relaxed);
+        stats->dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        stats->blocked += atomic_load_explicit(&ring->blocked, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+}
+
+int dc_fsm_info_set_async(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          struct dc_fsm_async *async)
+{
+    struct fsm_async_ring *ring;
+
+    DC_TRACE(env);
+
+    if(info->async_ring)
+    {
+        fsm_async_detach(env, info);
+    }
+
+    if(async == NULL)
+    {
+        return 0;
+    }
+
+    ring = dc_calloc(env, err, 1, sizeof(struct fsm_async_ring) + async->capacity * sizeof(struct fsm_async_event));
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    ring->info  = info;
+    ring->async = async;
+    ring->mask  = async->capacity - 1;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->enqueued, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->blocked, 0);
+    atomic_init(&ring->head, 0);
+
+    pthread_mutex_lock(&async->mutex);
+    ring->next   = async->rings;
+    async->rings = ring;
+    pthread_mutex_unlock(&async->mutex);
+    info->async_ring = ring;
+
+    return 0;
+}
+
+void fsm_async_push(
+    struct fsm_async_ring *ring, enum fsm_notification kind, int from_state_id, int to_state_id, int next_id)
+{
+    struct fsm_async_event *event;
+    size_t                  tail;
+    size_t                  head;
+    bool                    waited;
+
+    atomic_fetch_add_explicit(&ring->enqueued, 1, memory_order_relaxed);
+    tail   = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head   = atomic_load_explicit(&ring->head, memory_order_acquire);
+    waited = false;
+
+    while(tail - head > ring->mask)
+    {
+        if(ring->async->policy == DC_FSM_ASYNC_DROP)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+
+            return;
+        }
+
+        if(!waited)
+        {
+            atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+            waited = true;
+        }
+
+        pthread_cond_signal(&ring->async->wake);
+        sched_yield();
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+
+    event                = &ring->events[tail & ring->mask];
+    event->kind          = kind;
+    event->from_state_id = from_state_id;
+    event->to_state_id   = to_state_id;
+    event->next_id       = next_id;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // wake the consumer when the ring gets half full instead of leaving it to its idle poll, or a burst would overflow
+    // the ring before it looked; head only moves forward, so the size grows one at a time and this is hit once a fill
+    if(tail + 1 - head == (ring->mask + 1) / 2)
+    {
+        pthread_cond_signal(&ring->async->wake);
+    }
+}
+
+void fsm_async_detach(const struct dc_env *env, struct dc_fsm_info *info)
+{
+    struct fsm_async_ring  *ring;
+    struct dc_fsm_async    *async;
+    struct fsm_async_ring **link;
+    size_t                  count;
+
+    DC_TRACE(env);
+    ring  = info->async_ring;
+    async = ring->async;
+    pthread_mutex_lock(&async->mutex);
+
+    if(async_is_consumer(async))
+    {
+        // a notifier detaching its own machine cannot wait for its own batch, so that batch frees the ring instead
+        if(ring->busy)
+        {
+            ring->orphaned = true;
+        }
+        else
+        {
+            // one of these notifiers may detach or destroy the machine itself, orphaning the ring, which is then
+            // left for this call to free
+            ring->draining = true;
+
+            while(!ring->orphaned && async_is_pending(ring))
+            {
+                count = 0;
+                async_deliver_batch(async, ring, &count);
+            }
+
+            if(ring->orphaned)
+            {
+                pthread_mutex_unlock(&async->mutex);
+                dc_free(env, ring);
+
+                return;
+            }
+        }
+    }
+    else
+    {
+        // this thread is the only producer, so once the consumer has caught up nothing more arrives
+        while(!async->stopped && (ring->busy || async_is_pending(ring)))
+        {
+            pthread_cond_signal(&async->wake);
+            pthread_cond_wait(&async->idle, &async->mutex);
+        }
+    }
+
+    link = &async->rings;
+
+    while(*link != ring)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = ring->next;
+    count = atomic_load_explicit(&ring->tail, memory_order_acquire) -
+            atomic_load_explicit(&ring->head, memory_order_relaxed);
+    async->retired.enqueued += atomic_load_explicit(&ring->enqueued, memory_order_relaxed);
+    async->retired.dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed) + count;
+    async->retired.blocked += atomic_load_explicit(&ring->blocked, memory_order_relaxed);
+    info->async_ring = NULL;
+
+    if(!ring->orphaned)
+    {
+        dc_free(env, ring);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+}
+
+static void *async_consume(void *arg)
+{
+    struct dc_fsm_async *async;
+
+    async = arg;
+    pthread_mutex_lock(&async->mutex);
+
+    // when stopping, keep going until a pass finds nothing left to deliver
+    for(;;)
+    {
+        struct fsm_async_ring *ring;
+        size_t                 count;
+
+        count = 0;
+        ring  = async->rings;
+
+        while(ring)
+        {
+            ring = ring->busy ? ring->next : async_deliver_batch(async, ring, &count);
+        }
+
+        pthread_cond_broadcast(&async->idle);
+
+        if(count == 0)
+        {
+            struct timespec deadline;
+
+            if(async->stopping)
+            {
+                break;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+
+            if(deadline.tv_nsec >= NSEC_PER_SEC - ASYNC_IDLE_NSEC)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= NSEC_PER_SEC - ASYNC_IDLE_NSEC;
+            }
+            else
+            {
+                deadline.tv_nsec += ASYNC_IDLE_NSEC;
+            }
+
+            pthread_cond_timedwait(&async->wake, &async->mutex, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+// called with the mutex held; the batch is copied out and delivered with the mutex released, so a slow notifier does
+// not hold up other machines and can call back into the library; returns the next ring, NULL if ring was detached
+static struct fsm_async_ring *
+async_deliver_batch(struct dc_fsm_async *async, struct fsm_async_ring *ring, size_t *count)
+{
+    struct fsm_async_event batch[ASYNC_BATCH_SIZE];
+    struct fsm_async_ring *next;
+    size_t                 head;
+    size_t                 size;
+    size_t                 delivered;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+
+    if(size == 0)
+    {
+        return ring->next;
+    }
+
+    if(size > ASYNC_BATCH_SIZE)
+    {
+        size = ASYNC_BATCH_SIZE;
+    }
+
+    for(size_t i = 0; i < size; i++)
+    {
+        batch[i] = ring->events[(head + i) & ring->mask];
+    }
+
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+    ring->busy = true;
+    pthread_mutex_unlock(&async->mutex);
+
+    // only this thread can orphan the ring while it is busy, from inside one of these notifiers
+    for(delivered = 0; delivered < size && !ring->orphaned; delivered++)
+    {
+        async_deliver(async, ring->info, &batch[delivered]);
+    }
+
+    pthread_mutex_lock(&async->mutex);
+    async->delivered += delivered;
+    async->batches++;
+    *count += size;
+    ring->busy = false;
+    next       = ring->next;
+
+    if(ring->orphaned)
+    {
+        async->retired.dropped += size - delivered;
+        next = NULL;
+
+        if(!ring->draining)
+        {
+            dc_free(async->env, ring);
+        }
+    }
+
+    pthread_cond_broadcast(&async->idle);
+
+    return next;
+}
+
+static bool async_is_pending(const struct fsm_async_ring *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) !=
+           atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+// called with the mutex held
+static bool async_is_flushed(const struct dc_fsm_async *async)
+{
+    for(const struct fsm_async_ring *ring = async->rings; ring; ring = ring->next)
+    {
+        if(ring->busy || async_is_pending(ring))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool async_is_consumer(const struct dc_fsm_async *async)
+{
+    return pthread_equal(async->thread, pthread_self()) != 0;
+}
+
+static void async_deliver(struct dc_fsm_async *async, struct dc_fsm_info *info, const struct fsm_async_event *event)
+{
+    switch(event->kind)
+    {
+        case FSM_WILL_CHANGE_STATE:
+        {
+            if(info->will_change_state)
+            {
+                info->will_change_state(
+                    async->env, async->notifier_err, info, event->from_state_id, event->to_state_id);
+            }
+
+            break;
+        }
+        case FSM_DID_CHANGE_STATE:
+        {
+            if(info->did_change_state)
+            {
+                info->did_change_state(async->env,
+                                       async->notifier_err,
+                                       info,
+                                       event->from_state_id,
+                                       event->to_state_id,
+                                       event->next_id);
+            }
+
+            break;
+        }
+        case FSM_BAD_CHANGE_STATE:
+        {
+            if(info->bad_change_state)
+            {
+                info->bad_change_state(async->env, async->notifier_err, info, event->from_state_id, event->to_state_id);
+            }
+
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+}
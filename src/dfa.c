@@ -0,0 +1,1117 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dc_fsm/dfa.h"
+#include "fsm_internal.h"
+#include <dc_c/dc_stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if(defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define DFA_HAVE_SSSE3
+    #include <tmmintrin.h>
+#endif
+
+
+// a row entry is the next state's row offset (index * 256), with this bit set when the byte needs the slow path
+#define DFA_SLOW 0x80000000U
+#define DFA_ROW_SHIFT 8
+#define DFA_LANES 16
+#define DFA_BLOCK_SIZE 64
+#define DFA_MIN_CHUNK_SIZE (64 * 1024)
+#define DFA_RECORD_SPACING 16
+#define DFA_MAX_RECORDS (1024 * 1024)
+
+
+struct dc_fsm_dfa
+{
+    size_t                        state_count;
+    int                           state_ids[DC_FSM_DFA_MAX_STATES];
+    size_t                        class_count;
+    unsigned char                 class_map[UCHAR_MAX + 1];
+    uint32_t                     *rows;
+    int                          *actions;
+    struct dc_fsm_dfa_transition *transitions;
+    uint32_t                     *to_rows;
+    size_t                        transition_count;
+    unsigned char (*shuffle)[DFA_LANES];
+    unsigned char (*slow)[DFA_LANES];
+};
+
+// an action met on one of a chunk's paths, and the state it was met in
+struct dfa_record
+{
+    size_t        offset;
+    unsigned char path;
+    unsigned char state;
+};
+
+// one path per start state, run on the assumption that every perform returns its to_id; a path that meets another
+// in the same state is merged into it, and one that meets an exit, a missing transition, or has no room left to
+// record an action stops there
+struct dfa_chunk
+{
+    const struct dc_fsm_dfa *dfa;
+    const unsigned char     *bytes;
+    size_t                   begin;
+    size_t                   end;
+    uint32_t                 rows[DC_FSM_DFA_MAX_STATES];
+    size_t                   stops[DC_FSM_DFA_MAX_STATES];
+    size_t                   merged_at[DC_FSM_DFA_MAX_STATES];
+    unsigned char            merged_into[DC_FSM_DFA_MAX_STATES];
+    struct dfa_record       *records;
+    size_t                   record_count;
+    size_t                   record_capacity;
+    pthread_t                thread;
+    bool                     started;
+};
+
+static int    dfa_add_id(int ids[], size_t *count, size_t max, int id);
+static int    dfa_state_index(const struct dc_fsm_dfa *dfa, int state_id);
+static int    dfa_build(const struct dc_env *env, struct dc_error *err, struct dc_fsm_dfa *dfa);
+static int    dfa_start(const struct dc_env     *env,
+                        struct dc_error         *err,
+                        struct dc_fsm_info      *info,
+                        const struct dc_fsm_dfa *dfa,
+                        uint32_t                *prow);
+static int    dfa_run_range(const struct dc_env     *env,
+                            struct dc_error         *err,
+                            struct dc_fsm_info      *info,
+                            const struct dc_fsm_dfa *dfa,
+                            const unsigned char     *bytes,
+                            size_t                   length,
+                            size_t                   begin,
+                            size_t                   end,
+                            uint32_t                *prow,
+                            size_t                  *poffset,
+                            void                    *arg);
+static int    dfa_run_chunks(const struct dc_env     *env,
+                             struct dc_error         *err,
+                             struct dc_fsm_info      *info,
+                             const struct dc_fsm_dfa *dfa,
+                             const unsigned char     *bytes,
+                             size_t                   length,
+                             size_t                   chunk_count,
+                             uint32_t                *prow,
+                             size_t                  *poffset,
+                             void                    *arg);
+static int    dfa_replay(const struct dc_env     *env,
+                         struct dc_error         *err,
+                         struct dc_fsm_info      *info,
+                         const unsigned char     *bytes,
+                         size_t                   length,
+                         const struct dfa_chunk  *chunk,
+                         uint32_t                *prow,
+                         size_t                  *poffset,
+                         void                    *arg);
+static int    dfa_action(const struct dc_env     *env,
+                         struct dc_error         *err,
+                         struct dc_fsm_info      *info,
+                         const struct dc_fsm_dfa *dfa,
+                         const unsigned char     *bytes,
+                         size_t                   length,
+                         size_t                   offset,
+                         uint32_t                *prow,
+                         void                    *arg);
+static size_t dfa_scan(const struct dc_fsm_dfa *dfa,
+                       const unsigned char     *bytes,
+                       size_t                   offset,
+                       size_t                   length,
+                       uint32_t                *prow,
+                       size_t                  *simd_resume);
+static size_t
+dfa_scan_scalar(const uint32_t *rows, const unsigned char *bytes, size_t offset, size_t length, uint32_t *prow);
+static void  *dfa_chunk_thread(void *arg);
+static void   dfa_speculate(struct dfa_chunk *chunk);
+static void   dfa_speculate_path(struct dfa_chunk *chunk, size_t path, size_t offset, size_t end);
+static void dfa_raise(const struct dc_env *env, struct dc_error *err, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#ifdef DFA_HAVE_SSSE3
+static bool dfa_has_ssse3(void);
+static void dfa_compose_ssse3(const struct dc_fsm_dfa *dfa,
+                              const unsigned char     *bytes,
+                              size_t                   length,
+                              unsigned char            lanes[DFA_LANES],
+                              unsigned char            hits[DFA_LANES]);
+#endif
+
+struct dc_fsm_dfa *dc_fsm_dfa_create(const struct dc_env                *env,
+                                     struct dc_error                    *err,
+                                     const struct dc_fsm_dfa_class       classes[],
+                                     const struct dc_fsm_dfa_transition  transitions[])
+{
+    struct dc_fsm_dfa *dfa;
+    int                class_ids[UCHAR_MAX + 1];
+
+    DC_TRACE(env);
+    dfa = dc_calloc(env, err, 1, sizeof(struct dc_fsm_dfa));
+
+    if(dc_error_has_error(err))
+    {
+        return NULL;
+    }
+
+    class_ids[0]     = DC_FSM_DFA_CLASS_OTHER;
+    dfa->class_count = 1;
+
+    for(const struct dc_fsm_dfa_class *byte_class = classes; byte_class->class_id != DC_FSM_IGNORE; byte_class++)
+    {
+        int index;
+
+        index = dfa_add_id(class_ids, &dfa->class_count, UCHAR_MAX + 1, byte_class->class_id);
+
+        if(index < 0)
+        {
+            dfa_raise(env, err, "Too many byte classes: %d", byte_class->class_id);
+            dc_fsm_dfa_destroy(env, &dfa);
+
+            return NULL;
+        }
+
+        for(unsigned int c = byte_class->first; c <= byte_class->last; c++)
+        {
+            dfa->class_map[c] = (unsigned char)index;
+        }
+    }
+
+    while(transitions[dfa->transition_count].from_id != DC_FSM_IGNORE)
+    {
+        const struct dc_fsm_dfa_transition *transition;
+
+        transition = &transitions[dfa->transition_count];
+
+        if(dfa_add_id(class_ids, &dfa->class_count, UCHAR_MAX + 1, transition->class_id) < 0 ||
+           dfa_add_id(dfa->state_ids, &dfa->state_count, DC_FSM_DFA_MAX_STATES, transition->from_id) < 0 ||
+           dfa_add_id(dfa->state_ids, &dfa->state_count, DC_FSM_DFA_MAX_STATES, transition->to_id) < 0)
+        {
+            dfa_raise(env, err, "Too many states or classes: %d -> %d", transition->from_id, transition->to_id);
+            dc_fsm_dfa_destroy(env, &dfa);
+
+            return NULL;
+        }
+
+        dfa->transition_count++;
+    }
+
+    dfa->transitions = dc_malloc(env, err, (dfa->transition_count + 1) * sizeof(struct dc_fsm_dfa_transition));
+
+    if(dc_error_has_no_error(err))
+    {
+        // the class ids are only needed to turn the user's class ids into indexes
+        for(size_t i = 0; i < dfa->transition_count; i++)
+        {
+            dfa->transitions[i]          = transitions[i];
+            dfa->transitions[i].class_id =
+                dfa_add_id(class_ids, &dfa->class_count, UCHAR_MAX + 1, transitions[i].class_id);
+        }
+
+        dfa_build(env, err, dfa);
+    }
+
+    if(dc_error_has_error(err))
+    {
+        dc_fsm_dfa_destroy(env, &dfa);
+    }
+
+    return dfa;
+}
+
+void dc_fsm_dfa_destroy(const struct dc_env *env, struct dc_fsm_dfa **pdfa)
+{
+    struct dc_fsm_dfa *dfa;
+
+    DC_TRACE(env);
+    dfa = *pdfa;
+
+    if(dfa->slow)
+    {
+        dc_free(env, dfa->slow);
+    }
+
+    if(dfa->shuffle)
+    {
+        dc_free(env, dfa->shuffle);
+    }
+
+    if(dfa->rows)
+    {
+        dc_free(env, dfa->rows);
+    }
+
+    if(dfa->actions)
+    {
+        dc_free(env, dfa->actions);
+    }
+
+    if(dfa->transitions)
+    {
+        dc_free(env, dfa->transitions);
+    }
+
+    if(dfa->to_rows)
+    {
+        dc_free(env, dfa->to_rows);
+    }
+
+    dc_free(env, dfa);
+    *pdfa = NULL;
+}
+
+int dc_fsm_dfa_run(const struct dc_env     *env,
+                   struct dc_error         *err,
+                   struct dc_fsm_info      *info,
+                   const struct dc_fsm_dfa *dfa,
+                   const void              *data,
+                   size_t                   length,
+                   size_t                  *consumed,
+                   void                    *arg)
+{
+    size_t   offset;
+    uint32_t row;
+    int      status;
+
+    DC_TRACE(env);
+    offset = 0;
+    status = dfa_start(env, err, info, dfa, &row);
+
+    if(status == 0)
+    {
+        status = dfa_run_range(env, err, info, dfa, data, length, 0, length, &row, &offset, arg);
+    }
+
+    // the action has already stored the state if it exited or failed
+    if(status == 0)
+    {
+        fsm_set_current_state(info, dfa->state_ids[row >> DFA_ROW_SHIFT]);
+    }
+
+    if(consumed)
+    {
+        *consumed = offset;
+    }
+
+    return status < 0 ? -1 : 0;
+}
+
+int dc_fsm_dfa_run_parallel(const struct dc_env     *env,
+                            struct dc_error         *err,
+                            struct dc_fsm_info      *info,
+                            const struct dc_fsm_dfa *dfa,
+                            const void              *data,
+                            size_t                   length,
+                            size_t                   thread_count,
+                            size_t                  *consumed,
+                            void                    *arg)
+{
+    size_t   chunk_count;
+    size_t   offset;
+    uint32_t row;
+    int      status;
+
+    DC_TRACE(env);
+    chunk_count = length / DFA_MIN_CHUNK_SIZE;
+
+    if(thread_count < chunk_count)
+    {
+        chunk_count = thread_count;
+    }
+
+    if(chunk_count < 2)
+    {
+        return dc_fsm_dfa_run(env, err, info, dfa, data, length, consumed, arg);
+    }
+
+    offset = 0;
+    status = dfa_start(env, err, info, dfa, &row);
+
+    if(status == 0)
+    {
+        status = dfa_run_chunks(env, err, info, dfa, data, length, chunk_count, &row, &offset, arg);
+    }
+
+    if(status == 0)
+    {
+        fsm_set_current_state(info, dfa->state_ids[row >> DFA_ROW_SHIFT]);
+    }
+
+    if(consumed)
+    {
+        *consumed = offset;
+    }
+
+    return status < 0 ? -1 : 0;
+}
+
+static int dfa_add_id(int ids[], size_t *count, size_t max, int id)
+{
+    for(size_t i = 0; i < *count; i++)
+    {
+        if(ids[i] == id)
+        {
+            return (int)i;
+        }
+    }
+
+    if(*count == max)
+    {
+        return -1;
+    }
+
+    ids[*count] = id;
+    (*count)++;
+
+    return (int)(*count - 1);
+}
+
+static int dfa_state_index(const struct dc_fsm_dfa *dfa, int state_id)
+{
+    for(size_t i = 0; i < dfa->state_count; i++)
+    {
+        if(dfa->state_ids[i] == state_id)
+        {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+static int dfa_build(const struct dc_env *env, struct dc_error *err, struct dc_fsm_dfa *dfa)
+{
+    DC_TRACE(env);
+    dfa->actions = dc_malloc(env, err, dfa->state_count * dfa->class_count * sizeof(int));
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    for(size_t i = 0; i < dfa->state_count * dfa->class_count; i++)
+    {
+        dfa->actions[i] = -1;
+    }
+
+    // the first declaration of a from/class pair wins, the same as dc_fsm_run
+    for(size_t i = dfa->transition_count; i > 0; i--)
+    {
+        const struct dc_fsm_dfa_transition *transition;
+        int                                 from;
+
+        transition = &dfa->transitions[i - 1];
+        from       = dfa_state_index(dfa, transition->from_id);
+        dfa->actions[(size_t)from * dfa->class_count + (size_t)transition->class_id] = (int)(i - 1);
+    }
+
+    // the row of each transition's to_id, so an action that follows its transition does not search the states
+    dfa->to_rows = dc_malloc(env, err, (dfa->transition_count + 1) * sizeof(uint32_t));
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    for(size_t i = 0; i < dfa->transition_count; i++)
+    {
+        dfa->to_rows[i] = (uint32_t)dfa_state_index(dfa, dfa->transitions[i].to_id) << DFA_ROW_SHIFT;
+    }
+
+    dfa->rows = dc_malloc(env, err, dfa->state_count * (UCHAR_MAX + 1) * sizeof(uint32_t));
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    for(size_t state = 0; state < dfa->state_count; state++)
+    {
+        for(size_t c = 0; c <= UCHAR_MAX; c++)
+        {
+            const struct dc_fsm_dfa_transition *transition;
+            uint32_t                           *entry;
+            int                                 action;
+
+            entry  = &dfa->rows[(state << DFA_ROW_SHIFT) + c];
+            action = dfa->actions[state * dfa->class_count + dfa->class_map[c]];
+
+            if(action < 0)
+            {
+                *entry = DFA_SLOW | (uint32_t)(state << DFA_ROW_SHIFT);
+                continue;
+            }
+
+            transition = &dfa->transitions[action];
+            *entry     = dfa->to_rows[action];
+
+            if(transition->perform || transition->to_id == DC_FSM_EXIT)
+            {
+                *entry |= DFA_SLOW;
+            }
+        }
+    }
+
+    // small machines can step every state at once with a byte shuffle
+    if(dfa->state_count > DFA_LANES)
+    {
+        return 0;
+    }
+
+    dfa->shuffle = dc_malloc(env, err, (UCHAR_MAX + 1) * DFA_LANES);
+
+    if(dc_error_has_no_error(err))
+    {
+        dfa->slow = dc_malloc(env, err, (UCHAR_MAX + 1) * DFA_LANES);
+    }
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    for(size_t c = 0; c <= UCHAR_MAX; c++)
+    {
+        for(size_t lane = 0; lane < DFA_LANES; lane++)
+        {
+            uint32_t entry;
+
+            entry = lane < dfa->state_count ? dfa->rows[(lane << DFA_ROW_SHIFT) + c] : DFA_SLOW;
+
+            if(entry & DFA_SLOW)
+            {
+                dfa->shuffle[c][lane] = (unsigned char)lane;
+                dfa->slow[c][lane]    = UCHAR_MAX;
+            }
+            else
+            {
+                dfa->shuffle[c][lane] = (unsigned char)(entry >> DFA_ROW_SHIFT);
+                dfa->slow[c][lane]    = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int dfa_start(const struct dc_env     *env,
+                     struct dc_error         *err,
+                     struct dc_fsm_info      *info,
+                     const struct dc_fsm_dfa *dfa,
+                     uint32_t                *prow)
+{
+    int from_id;
+    int to_id;
+    int index;
+
+    DC_TRACE(env);
+    from_id = fsm_get_from_state_id(info);
+    to_id   = fsm_get_current_state_id(info);
+    index   = dfa_state_index(dfa, to_id);
+
+    if(index < 0)
+    {
+        fsm_bad_change_state(env, err, info, from_id, to_id);
+
+        dfa_raise(env, err, "Unknown state transition: %d -> %d ", from_id, to_id);
+
+        return -1;
+    }
+
+    *prow = (uint32_t)index << DFA_ROW_SHIFT;
+
+    return 0;
+}
+
+static int dfa_run_range(const struct dc_env     *env,
+                         struct dc_error         *err,
+                         struct dc_fsm_info      *info,
+                         const struct dc_fsm_dfa *dfa,
+                         const unsigned char     *bytes,
+                         size_t                   length,
+                         size_t                   begin,
+                         size_t                   end,
+                         uint32_t                *prow,
+                         size_t                  *poffset,
+                         void                    *arg)
+{
+    size_t offset;
+    size_t simd_resume;
+    int    status;
+
+    DC_TRACE(env);
+    offset      = begin;
+    simd_resume = begin;
+    status      = 0;
+
+    while(offset < end)
+    {
+        offset = dfa_scan(dfa, bytes, offset, end, prow, &simd_resume);
+
+        if(offset == end)
+        {
+            break;
+        }
+
+        status = dfa_action(env, err, info, dfa, bytes, length, offset, prow, arg);
+
+        if(status < 0)
+        {
+            break;
+        }
+
+        offset++;
+
+        if(status > 0)
+        {
+            break;
+        }
+    }
+
+    *poffset = offset;
+
+    return status;
+}
+
+static int dfa_run_chunks(const struct dc_env     *env,
+                          struct dc_error         *err,
+                          struct dc_fsm_info      *info,
+                          const struct dc_fsm_dfa *dfa,
+                          const unsigned char     *bytes,
+                          size_t                   length,
+                          size_t                   chunk_count,
+                          uint32_t                *prow,
+                          size_t                  *poffset,
+                          void                    *arg)
+{
+    struct dfa_chunk  *chunks;
+    struct dfa_record *records;
+    size_t             chunk_length;
+    size_t             record_capacity;
+    int                status;
+
+    DC_TRACE(env);
+    chunk_length    = length / chunk_count;
+    record_capacity = chunk_length / DFA_RECORD_SPACING < DFA_MAX_RECORDS ? chunk_length / DFA_RECORD_SPACING
+                                                                          : DFA_MAX_RECORDS;
+    chunks          = dc_calloc(env, err, chunk_count, sizeof(struct dfa_chunk));
+
+    if(dc_error_has_error(err))
+    {
+        return -1;
+    }
+
+    // the first chunk starts in a known state, so it needs nowhere to record its actions
+    records = dc_malloc(env, err, (chunk_count - 1) * record_capacity * sizeof(struct dfa_record));
+
+    if(dc_error_has_error(err))
+    {
+        dc_free(env, chunks);
+
+        return -1;
+    }
+
+    for(size_t i = 0; i < chunk_count; i++)
+    {
+        chunks[i].dfa   = dfa;
+        chunks[i].bytes = bytes;
+        chunks[i].begin = chunk_length * i;
+        chunks[i].end   = i + 1 == chunk_count ? length : chunk_length * (i + 1);
+
+        if(i > 0)
+        {
+            chunks[i].records         = &records[(i - 1) * record_capacity];
+            chunks[i].record_capacity = record_capacity;
+            chunks[i].started         = pthread_create(&chunks[i].thread, NULL, dfa_chunk_thread, &chunks[i]) == 0;
+        }
+    }
+
+    status = dfa_run_range(env, err, info, dfa, bytes, length, 0, chunks[0].end, prow, poffset, arg);
+
+    // stitch the chunks together from the real start state of each, running the actions the thread recorded
+    for(size_t i = 1; i < chunk_count; i++)
+    {
+        if(chunks[i].started)
+        {
+            pthread_join(chunks[i].thread, NULL);
+
+            if(status == 0)
+            {
+                status = dfa_replay(env, err, info, bytes, length, &chunks[i], prow, poffset, arg);
+            }
+        }
+        else if(status == 0)
+        {
+            status =
+                dfa_run_range(env, err, info, dfa, bytes, length, chunks[i].begin, chunks[i].end, prow, poffset, arg);
+        }
+    }
+
+    dc_free(env, records);
+    dc_free(env, chunks);
+
+    return status;
+}
+
+static int dfa_replay(const struct dc_env     *env,
+                      struct dc_error         *err,
+                      struct dc_fsm_info      *info,
+                      const unsigned char     *bytes,
+                      size_t                   length,
+                      const struct dfa_chunk  *chunk,
+                      uint32_t                *prow,
+                      size_t                  *poffset,
+                      void                    *arg)
+{
+    const struct dc_fsm_dfa *dfa;
+    size_t                   path;
+
+    DC_TRACE(env);
+    dfa  = chunk->dfa;
+    path = *prow >> DFA_ROW_SHIFT;
+
+    for(size_t i = 0; i < chunk->record_count; i++)
+    {
+        const struct dfa_record *record;
+        uint32_t                 expected;
+        int                      status;
+
+        // a path only follows the one it merged into from the records made after the merge
+        while(chunk->merged_at[path] <= i)
+        {
+            path = chunk->merged_into[path];
+        }
+
+        record = &chunk->records[i];
+
+        if(record->path != path)
+        {
+            continue;
+        }
+
+        *prow    = (uint32_t)record->state << DFA_ROW_SHIFT;
+        expected = dfa->to_rows[dfa->actions[record->state * dfa->class_count + dfa->class_map[bytes[record->offset]]]];
+        status   = dfa_action(env, err, info, dfa, bytes, length, record->offset, prow, arg);
+        *poffset = status < 0 ? record->offset : record->offset + 1;
+
+        if(status != 0)
+        {
+            return status;
+        }
+
+        // the perform went somewhere else, so the rest of the path is wrong
+        if(*prow != expected)
+        {
+            return dfa_run_range(
+                env, err, info, dfa, bytes, length, record->offset + 1, chunk->end, prow, poffset, arg);
+        }
+    }
+
+    while(chunk->merged_at[path] != SIZE_MAX)
+    {
+        path = chunk->merged_into[path];
+    }
+
+    *prow    = chunk->rows[path];
+    *poffset = chunk->stops[path];
+
+    if(chunk->stops[path] < chunk->end)
+    {
+        return dfa_run_range(env, err, info, dfa, bytes, length, chunk->stops[path], chunk->end, prow, poffset, arg);
+    }
+
+    return 0;
+}
+
+static int dfa_action(const struct dc_env     *env,
+                      struct dc_error         *err,
+                      struct dc_fsm_info      *info,
+                      const struct dc_fsm_dfa *dfa,
+                      const unsigned char     *bytes,
+                      size_t                   length,
+                      size_t                   offset,
+                      uint32_t                *prow,
+                      void                    *arg)
+{
+    const struct dc_fsm_dfa_transition *transition;
+    int                                 from_id;
+    int                                 next_id;
+    int                                 action;
+    int                                 index;
+
+    DC_TRACE(env);
+    from_id = dfa->state_ids[*prow >> DFA_ROW_SHIFT];
+    action  = dfa->actions[(*prow >> DFA_ROW_SHIFT) * dfa->class_count + dfa->class_map[bytes[offset]]];
+
+    if(action < 0)
+    {
+        fsm_set_current_state(info, from_id);
+        fsm_bad_change_state(env, err, info, from_id, DC_FSM_IGNORE);
+
+        dfa_raise(env, err, "Unknown byte transition: %d on 0x%02x ", from_id, bytes[offset]);
+
+        return -1;
+    }
+
+    transition = &dfa->transitions[action];
+
+    // notify moving to
+    fsm_will_change_state(env, err, info, from_id, transition->to_id);
+
+    fsm_set_state(info, from_id, transition->to_id);
+    fsm_count_transition(info);
+    next_id = transition->to_id;
+
+    if(transition->perform)
+    {
+        struct dc_fsm_dfa_event event;
+
+        event.data    = bytes;
+        event.length  = length;
+        event.offset  = offset;
+        event.from_id = from_id;
+        event.to_id   = transition->to_id;
+        event.arg     = arg;
+        next_id       = transition->perform(env, err, &event);
+
+        if(next_id == DC_FSM_IGNORE)
+        {
+            next_id = transition->to_id;
+        }
+    }
+
+    // notify moving from
+    fsm_did_change_state(env, err, info, from_id, transition->to_id, next_id);
+
+    if(next_id == DC_FSM_EXIT)
+    {
+        fsm_set_current_state(info, DC_FSM_EXIT);
+
+        return 1;
+    }
+
+    if(next_id == transition->to_id)
+    {
+        *prow = dfa->to_rows[action];
+
+        return 0;
+    }
+
+    index = dfa_state_index(dfa, next_id);
+
+    if(index < 0)
+    {
+        fsm_bad_change_state(env, err, info, transition->to_id, next_id);
+
+        dfa_raise(env, err, "Unknown state transition: %d -> %d ", transition->to_id, next_id);
+
+        return -1;
+    }
+
+    *prow = (uint32_t)index << DFA_ROW_SHIFT;
+
+    return 0;
+}
+
+static size_t dfa_scan(const struct dc_fsm_dfa *dfa,
+                       const unsigned char     *bytes,
+                       size_t                   offset,
+                       size_t                   length,
+                       uint32_t                *prow,
+                       size_t                  *simd_resume)
+{
+#ifdef DFA_HAVE_SSSE3
+    if(dfa->shuffle && dfa_has_ssse3())
+    {
+        while(length - offset >= DFA_BLOCK_SIZE)
+        {
+            size_t limit;
+            size_t stop;
+
+            if(offset >= *simd_resume)
+            {
+                unsigned char lanes[DFA_LANES];
+                unsigned char hits[DFA_LANES] = {0};
+                size_t        state;
+
+                for(size_t lane = 0; lane < DFA_LANES; lane++)
+                {
+                    lanes[lane] = (unsigned char)lane;
+                }
+
+                dfa_compose_ssse3(dfa, &bytes[offset], DFA_BLOCK_SIZE, lanes, hits);
+                state = *prow >> DFA_ROW_SHIFT;
+
+                if(!hits[state])
+                {
+                    *prow = (uint32_t)lanes[state] << DFA_ROW_SHIFT;
+                    offset += DFA_BLOCK_SIZE;
+                    continue;
+                }
+
+                // the block has an action, back off so dense actions do not pay for the shuffles twice
+                *simd_resume = offset + 2 * DFA_BLOCK_SIZE;
+            }
+
+            limit = *simd_resume < length ? *simd_resume : length;
+            stop  = dfa_scan_scalar(dfa->rows, bytes, offset, limit, prow);
+
+            if(stop < limit)
+            {
+                return stop;
+            }
+
+            offset = stop;
+        }
+    }
+#endif
+
+    return dfa_scan_scalar(dfa->rows, bytes, offset, length, prow);
+}
+
+static size_t
+dfa_scan_scalar(const uint32_t *rows, const unsigned char *bytes, size_t offset, size_t length, uint32_t *prow)
+{
+    uint32_t row;
+
+    row = *prow;
+
+    while(offset < length)
+    {
+        uint32_t next;
+
+        next = rows[row + bytes[offset]];
+
+        if(next & DFA_SLOW)
+        {
+            break;
+        }
+
+        row = next;
+        offset++;
+    }
+
+    *prow = row;
+
+    return offset;
+}
+
+static void *dfa_chunk_thread(void *arg)
+{
+    dfa_speculate(arg);
+
+    return NULL;
+}
+
+static void dfa_speculate(struct dfa_chunk *chunk)
+{
+    const struct dc_fsm_dfa *dfa;
+    size_t                   live[DC_FSM_DFA_MAX_STATES];
+    size_t                   live_count;
+
+    dfa        = chunk->dfa;
+    live_count = dfa->state_count;
+
+    for(size_t state = 0; state < dfa->state_count; state++)
+    {
+        chunk->rows[state]        = (uint32_t)state << DFA_ROW_SHIFT;
+        chunk->stops[state]       = chunk->end;
+        chunk->merged_at[state]   = SIZE_MAX;
+        chunk->merged_into[state] = (unsigned char)state;
+        live[state]               = state;
+    }
+
+    for(size_t offset = chunk->begin; offset < chunk->end && live_count > 0; offset += DFA_BLOCK_SIZE)
+    {
+        size_t end;
+        size_t seen[DC_FSM_DFA_MAX_STATES];
+        bool   hits[DC_FSM_DFA_MAX_STATES];
+        size_t running_count;
+
+        end = chunk->end - offset < DFA_BLOCK_SIZE ? chunk->end : offset + DFA_BLOCK_SIZE;
+
+        for(size_t i = 0; i < live_count; i++)
+        {
+            hits[i] = true;
+        }
+
+#ifdef DFA_HAVE_SSSE3
+        // step every path through the block at once, leaving only the ones that meet an action to the table
+        if(dfa->shuffle && dfa_has_ssse3())
+        {
+            unsigned char lanes[DFA_LANES]     = {0};
+            unsigned char lane_hits[DFA_LANES] = {0};
+
+            for(size_t i = 0; i < live_count; i++)
+            {
+                lanes[i] = (unsigned char)(chunk->rows[live[i]] >> DFA_ROW_SHIFT);
+            }
+
+            dfa_compose_ssse3(dfa, &chunk->bytes[offset], end - offset, lanes, lane_hits);
+
+            for(size_t i = 0; i < live_count; i++)
+            {
+                if(lane_hits[i] == 0)
+                {
+                    chunk->rows[live[i]] = (uint32_t)lanes[i] << DFA_ROW_SHIFT;
+                    hits[i]              = false;
+                }
+            }
+        }
+#endif
+
+        for(size_t i = 0; i < live_count; i++)
+        {
+            if(hits[i])
+            {
+                dfa_speculate_path(chunk, live[i], offset, end);
+            }
+        }
+
+        for(size_t state = 0; state < dfa->state_count; state++)
+        {
+            seen[state] = SIZE_MAX;
+        }
+
+        running_count = 0;
+
+        for(size_t i = 0; i < live_count; i++)
+        {
+            size_t path;
+            size_t state;
+
+            path  = live[i];
+            state = chunk->rows[path] >> DFA_ROW_SHIFT;
+
+            if(chunk->stops[path] < chunk->end)
+            {
+                continue;
+            }
+
+            if(seen[state] == SIZE_MAX)
+            {
+                seen[state]           = path;
+                live[running_count++] = path;
+            }
+            else
+            {
+                chunk->merged_into[path] = (unsigned char)seen[state];
+                chunk->merged_at[path]   = chunk->record_count;
+            }
+        }
+
+        live_count = running_count;
+    }
+}
+
+static void dfa_speculate_path(struct dfa_chunk *chunk, size_t path, size_t offset, size_t end)
+{
+    const struct dc_fsm_dfa *dfa;
+    uint32_t                 row;
+
+    dfa = chunk->dfa;
+    row = chunk->rows[path];
+
+    for(;;)
+    {
+        struct dfa_record *record;
+        int                action;
+
+        offset = dfa_scan_scalar(dfa->rows, chunk->bytes, offset, end, &row);
+
+        if(offset == end)
+        {
+            break;
+        }
+
+        action = dfa->actions[(row >> DFA_ROW_SHIFT) * dfa->class_count + dfa->class_map[chunk->bytes[offset]]];
+
+        // the calling thread takes over from here with dfa_run_range, which knows what to do
+        if(action < 0 || dfa->transitions[action].to_id == DC_FSM_EXIT || chunk->record_count == chunk->record_capacity)
+        {
+            chunk->stops[path] = offset;
+            break;
+        }
+
+        record         = &chunk->records[chunk->record_count++];
+        record->offset = offset;
+        record->path   = (unsigned char)path;
+        record->state  = (unsigned char)(row >> DFA_ROW_SHIFT);
+        row            = dfa->to_rows[action];
+        offset++;
+    }
+
+    chunk->rows[path] = row;
+}
+
+static void dfa_raise(const struct dc_env *env, struct dc_error *err, const char *format, ...)
+{
+    va_list args;
+    char   *error_message;
+    size_t  error_message_size;
+
+    va_start(args, format);
+    error_message_size = (size_t)vsnprintf(NULL, 0, format, args) + 1;
+    va_end(args);
+    error_message = dc_malloc(env, err, error_message_size);
+
+    if(error_message)
+    {
+        va_start(args, format);
+        vsnprintf(error_message, error_message_size, format, args);  // NOLINT(cert-err33-c)
+        va_end(args);
+        DC_ERROR_RAISE_USER(err, error_message, 1);
+        dc_free(env, error_message);
+    }
+}
+
+#ifdef DFA_HAVE_SSSE3
+static bool dfa_has_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+// each lane steps on from the state it holds, hits marks lanes that needed the slow path on the way
+__attribute__((target("ssse3"))) static void dfa_compose_ssse3(const struct dc_fsm_dfa *dfa,
+                                                                const unsigned char     *bytes,
+                                                                size_t                   length,
+                                                                unsigned char            lanes[DFA_LANES],
+                                                                unsigned char            hits[DFA_LANES])
+{
+    __m128i current;
+    __m128i hit;
+
+    current = _mm_loadu_si128((const __m128i *)lanes);
+    hit     = _mm_loadu_si128((const __m128i *)hits);
+
+    for(size_t i = 0; i < length; i++)
+    {
+        __m128i shuffle;
+        __m128i slow;
+
+        shuffle = _mm_loadu_si128((const __m128i *)dfa->shuffle[bytes[i]]);
+        slow    = _mm_loadu_si128((const __m128i *)dfa->slow[bytes[i]]);
+        hit     = _mm_or_si128(hit, _mm_shuffle_epi8(slow, current));
+        current = _mm_shuffle_epi8(shuffle, current);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, current);
+    _mm_storeu_si128((__m128i *)hits, hit);
+}
+#endif
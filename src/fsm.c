@@ -16,41 +16,43 @@
 
 
 #include "dc_fsm/fsm.h"
+#include "fsm_internal.h"
 #include <dc_c/dc_stdlib.h>
 #include <dc_c/dc_string.h>
 #include <stdio.h>
 
 
-static dc_fsm_state_func
-fsm_transition(const struct dc_env *env, int from_id, int to_id, const struct dc_fsm_transition transitions[]);
+// the most guarded transitions out of one state that can be cached and reordered in a routing step
+#define FSM_MAX_ROUTE 32
+#define FSM_SELECTIVITY_SCALE 1024U
+
 
-struct dc_fsm_info
-{
-    char  *name;
-    size_t name_length;
-    int    from_state_id;
-    int    current_state_id;
-
-    void (*will_change_state)(const struct dc_env *env,
-                              struct dc_error           *err,
-                              const struct dc_fsm_info  *info,
-                              int                        from_state_id,
-                              int                        to_state_id);
-
-    void (*did_change_state)(const struct dc_env *env,
-                             struct dc_error           *err,
-                             const struct dc_fsm_info  *info,
-                             int                        from_state_id,
-                             int                        to_state_id,
-                             int                        next_id);
-
-    void (*bad_change_state)(const struct dc_env *env,
-                             struct dc_error           *err,
-                             const struct dc_fsm_info  *info,
-                             int                        from_state_id,
-                             int                        to_state_id);
+struct fsm_guard_result
+{
+    dc_fsm_guard_func          guard;
+    struct dc_fsm_guard_stats *stats;
+    bool                       passed;
 };
 
+static dc_fsm_state_func
+fsm_transition(const struct dc_env *env, int from_id, int to_id, const struct dc_fsm_transition transitions[]);
+static int  fsm_route(const struct dc_env            *env,
+                      struct dc_error                *err,
+                      struct dc_fsm_info             *info,
+                      int                             from_id,
+                      void                           *arg,
+                      const struct dc_fsm_transition  transitions[]);
+static bool fsm_guard(const struct dc_env     *env,
+                      struct dc_error         *err,
+                      struct dc_fsm_info      *info,
+                      dc_fsm_guard_func        guard,
+                      void                    *arg,
+                      struct fsm_guard_result  cache[],
+                      size_t                  *cache_count);
+static bool fsm_is_guarded(const struct dc_fsm_info *info, int from_id, int to_id);
+static struct dc_fsm_guard_stats *fsm_guard_stats(const struct dc_fsm_info *info, dc_fsm_guard_func guard);
+static size_t fsm_guard_selectivity(const struct dc_fsm_info *info, dc_fsm_guard_func guard);
+
 struct dc_fsm_info *dc_fsm_info_create(const struct dc_env *env, struct dc_error *err, const char *name)
 {
     struct dc_fsm_info *info;
@@ -60,10 +62,11 @@ struct dc_fsm_info *dc_fsm_info_create(const struct dc_env *env, struct dc_error
 
     if(dc_error_has_no_error(err))
     {
-        info->from_state_id    = DC_FSM_INIT;
-        info->current_state_id = DC_FSM_USER_START;
-        info->name_length      = dc_strlen(env, name) + 1;
-        info->name             = dc_malloc(env, err, info->name_length);
+        info->runtime     = &info->local;
+        info->name_length = dc_strlen(env, name) + 1;
+        info->name        = dc_malloc(env, err, info->name_length);
+        atomic_init(&info->local.state, fsm_pack_state(DC_FSM_INIT, DC_FSM_USER_START));
+        atomic_init(&info->local.transitions, 0);
 
         if(dc_error_has_no_error(err))
         {
@@ -90,6 +93,22 @@ void dc_fsm_info_destroy(const struct dc_env *env, struct dc_fsm_info **pinfo)
 
     DC_TRACE(env);
     info = *pinfo;
+
+    if(info->async_ring)
+    {
+        fsm_async_detach(env, info);
+    }
+
+    if(info->shm_slot)
+    {
+        fsm_shm_detach(info);
+    }
+
+    if(info->guard_stats)
+    {
+        dc_free(env, info->guard_stats);
+    }
+
     dc_free(env, info->name);
     dc_free(env, info);
     *pinfo = NULL;
@@ -126,6 +145,140 @@ void dc_fsm_info_set_bad_change_state(struct dc_fsm_info *info,
     info->bad_change_state = notifier;
 }
 
+void fsm_will_change_state(const struct dc_env *env,
+                           struct dc_error     *err,
+                           struct dc_fsm_info  *info,
+                           int                  from_state_id,
+                           int                  to_state_id)
+{
+    if(info->will_change_state)
+    {
+        if(info->async_ring)
+        {
+            fsm_async_push(info->async_ring, FSM_WILL_CHANGE_STATE, from_state_id, to_state_id, DC_FSM_IGNORE);
+        }
+        else
+        {
+            info->will_change_state(env, err, info, from_state_id, to_state_id);
+        }
+    }
+}
+
+void fsm_did_change_state(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          int                  from_state_id,
+                          int                  to_state_id,
+                          int                  next_id)
+{
+    if(info->did_change_state)
+    {
+        if(info->async_ring)
+        {
+            fsm_async_push(info->async_ring, FSM_DID_CHANGE_STATE, from_state_id, to_state_id, next_id);
+        }
+        else
+        {
+            info->did_change_state(env, err, info, from_state_id, to_state_id, next_id);
+        }
+    }
+}
+
+void fsm_bad_change_state(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          int                  from_state_id,
+                          int                  to_state_id)
+{
+    if(info->bad_change_state)
+    {
+        if(info->async_ring)
+        {
+            fsm_async_push(info->async_ring, FSM_BAD_CHANGE_STATE, from_state_id, to_state_id, DC_FSM_IGNORE);
+        }
+        else
+        {
+            info->bad_change_state(env, err, info, from_state_id, to_state_id);
+        }
+    }
+}
+
+int dc_fsm_info_set_guards(const struct dc_env       *env,
+                           struct dc_error           *err,
+                           struct dc_fsm_info        *info,
+                           const struct dc_fsm_guard  guards[])
+{
+    struct dc_fsm_guard_stats *guard_stats;
+    size_t                     guard_count;
+    size_t                     stats_count;
+
+    DC_TRACE(env);
+    guard_count = 0;
+
+    for(const struct dc_fsm_guard *guard = guards; guard && guard->from_id != DC_FSM_IGNORE; guard++)
+    {
+        guard_count++;
+    }
+
+    // one slot per guard function, allocated here so routing never has to
+    guard_stats = NULL;
+    stats_count = 0;
+
+    if(guard_count > 0)
+    {
+        guard_stats = dc_calloc(env, err, guard_count, sizeof(struct dc_fsm_guard_stats));
+
+        if(dc_error_has_error(err))
+        {
+            return -1;
+        }
+
+        for(size_t i = 0; i < guard_count; i++)
+        {
+            if(guards[i].guard)
+            {
+                size_t j;
+
+                for(j = 0; j < stats_count && guard_stats[j].guard != guards[i].guard; j++)
+                {
+                }
+
+                if(j == stats_count)
+                {
+                    guard_stats[stats_count].guard = guards[i].guard;
+                    stats_count++;
+                }
+            }
+        }
+    }
+
+    if(info->guard_stats)
+    {
+        dc_free(env, info->guard_stats);
+    }
+
+    info->guards            = guards;
+    info->guard_stats       = guard_stats;
+    info->guard_stats_count = stats_count;
+
+    return 0;
+}
+
+void dc_fsm_info_set_guard_ordering(struct dc_fsm_info *info, bool order_by_selectivity)
+{
+    info->order_guards = order_by_selectivity;
+}
+
+size_t dc_fsm_info_get_guard_stats(const struct dc_fsm_info *info, struct dc_fsm_guard_stats stats[], size_t max_stats)
+{
+    for(size_t i = 0; i < info->guard_stats_count && i < max_stats; i++)
+    {
+        stats[i] = info->guard_stats[i];
+    }
+
+    return info->guard_stats_count;
+}
+
 int dc_fsm_run(const struct dc_env     *env,
                struct dc_error               *err,
                struct dc_fsm_info            *info,
@@ -139,8 +292,8 @@ int dc_fsm_run(const struct dc_env     *env,
 
     DC_TRACE(env);
 
-    from_id = info->from_state_id;
-    to_id   = info->current_state_id;
+    from_id = fsm_get_from_state_id(info);
+    to_id   = fsm_get_current_state_id(info);
 
     do
     {
@@ -148,10 +301,7 @@ int dc_fsm_run(const struct dc_env     *env,
         int               next_id;
 
         // notify moving to
-        if(info->will_change_state)
-        {
-            info->will_change_state(env, err, info, from_id, to_id);
-        }
+        fsm_will_change_state(env, err, info, from_id, to_id);
 
         perform = fsm_transition(env, from_id, to_id, transitions);
 
@@ -171,12 +321,9 @@ int dc_fsm_run(const struct dc_env     *env,
             }
 
             // notify error
-            if(info->bad_change_state)
-            {
-                info->bad_change_state(env, err, info, from_id, to_id);
-            }
+            fsm_bad_change_state(env, err, info, from_id, to_id);
 
-            error_message_size = (size_t)snprintf(NULL, 0, "Unknown state transition: %d -> %d ", from_id, to_id);
+            error_message_size = (size_t)snprintf(NULL, 0, "Unknown state transition: %d -> %d ", from_id, to_id) + 1;
             error_message      = dc_malloc(env, err, error_message_size);
             sprintf(error_message, "Unknown state transition: %d -> %d ", from_id, to_id);  // NOLINT(cert-err33-c)
             DC_ERROR_RAISE_USER(err, error_message, 1);
@@ -185,18 +332,20 @@ int dc_fsm_run(const struct dc_env     *env,
             return -1;
         }
 
-        info->from_state_id    = from_id;
-        info->current_state_id = to_id;
-        from_id                = to_id;
-        next_id                = perform(env, err, arg);
+        fsm_set_state(info, from_id, to_id);
+        fsm_count_transition(info);
+        next_id = perform(env, err, arg);
 
-        // notify moving from
-        if(info->did_change_state)
+        // an unroutable state leaves DC_FSM_ROUTE as the next id, which is reported as an unknown transition
+        if(next_id == DC_FSM_ROUTE)
         {
-            info->did_change_state(env, err, info, info->from_state_id, info->current_state_id, next_id);
+            next_id = fsm_route(env, err, info, to_id, arg, transitions);
         }
 
-        to_id = next_id;
+        // notify moving from
+        fsm_did_change_state(env, err, info, from_id, to_id, next_id);
+        from_id = to_id;
+        to_id   = next_id;
 
         if(dc_error_has_error(err))
         {
@@ -236,8 +385,188 @@ fsm_transition(const struct dc_env *env, int from_id, int to_id, const struct dc
             return transition->perform;
         }
 
-        transition = transitions++;
+        transition++;
+    }
+
+    return NULL;
+}
+
+static int fsm_route(const struct dc_env            *env,
+                     struct dc_error                *err,
+                     struct dc_fsm_info             *info,
+                     int                             from_id,
+                     void                           *arg,
+                     const struct dc_fsm_transition  transitions[])
+{
+    const struct dc_fsm_guard *candidates[FSM_MAX_ROUTE];
+    size_t                     selectivity[FSM_MAX_ROUTE];
+    struct fsm_guard_result    cache[FSM_MAX_ROUTE];
+    size_t                     candidate_count;
+    size_t                     cache_count;
+
+    DC_TRACE(env);
+    candidate_count = 0;
+    cache_count     = 0;
+
+    for(const struct dc_fsm_guard *guard = info->guards; guard && guard->from_id != DC_FSM_IGNORE; guard++)
+    {
+        if(guard->from_id != from_id || guard->guard == NULL)
+        {
+            continue;
+        }
+
+        if(candidate_count < FSM_MAX_ROUTE)
+        {
+            candidates[candidate_count] = guard;
+        }
+
+        candidate_count++;
+    }
+
+    if(candidate_count > FSM_MAX_ROUTE)
+    {
+        // too many to keep track of, fall back to declaration order
+        for(const struct dc_fsm_guard *guard = info->guards; guard->from_id != DC_FSM_IGNORE; guard++)
+        {
+            if(guard->from_id == from_id && guard->guard &&
+               fsm_guard(env, err, info, guard->guard, arg, cache, &cache_count))
+            {
+                return guard->to_id;
+            }
+        }
+    }
+    else
+    {
+        if(info->order_guards)
+        {
+            // insertion sort, keeping declaration order between guards that are equally likely to pass
+            for(size_t i = 0; i < candidate_count; i++)
+            {
+                const struct dc_fsm_guard *candidate;
+                size_t                     rate;
+                size_t                     j;
+
+                candidate = candidates[i];
+                rate      = fsm_guard_selectivity(info, candidate->guard);
+
+                for(j = i; j > 0 && selectivity[j - 1] < rate; j--)
+                {
+                    candidates[j]  = candidates[j - 1];
+                    selectivity[j] = selectivity[j - 1];
+                }
+
+                candidates[j]  = candidate;
+                selectivity[j] = rate;
+            }
+        }
+
+        for(size_t i = 0; i < candidate_count; i++)
+        {
+            if(fsm_guard(env, err, info, candidates[i]->guard, arg, cache, &cache_count))
+            {
+                return candidates[i]->to_id;
+            }
+        }
+    }
+
+    for(const struct dc_fsm_transition *transition = transitions; transition->from_id != DC_FSM_IGNORE; transition++)
+    {
+        if(transition->from_id == from_id && !fsm_is_guarded(info, from_id, transition->to_id))
+        {
+            return transition->to_id;
+        }
+    }
+
+    return DC_FSM_ROUTE;
+}
+
+static bool fsm_guard(const struct dc_env     *env,
+                      struct dc_error         *err,
+                      struct dc_fsm_info      *info,
+                      dc_fsm_guard_func        guard,
+                      void                    *arg,
+                      struct fsm_guard_result  cache[],
+                      size_t                  *cache_count)
+{
+    struct dc_fsm_guard_stats *stats;
+    bool                       passed;
+
+    // the arg does not change during a step, so neither does the result of a guard
+    for(size_t i = 0; i < *cache_count; i++)
+    {
+        if(cache[i].guard == guard)
+        {
+            if(cache[i].stats)
+            {
+                cache[i].stats->cache_hits++;
+            }
+
+            return cache[i].passed;
+        }
+    }
+
+    passed = guard(env, err, arg);
+    stats  = fsm_guard_stats(info, guard);
+
+    if(*cache_count < FSM_MAX_ROUTE)
+    {
+        cache[*cache_count].guard  = guard;
+        cache[*cache_count].stats  = stats;
+        cache[*cache_count].passed = passed;
+        (*cache_count)++;
+    }
+
+    if(stats)
+    {
+        stats->evaluations++;
+
+        if(passed)
+        {
+            stats->passes++;
+        }
+    }
+
+    return passed;
+}
+
+static bool fsm_is_guarded(const struct dc_fsm_info *info, int from_id, int to_id)
+{
+    for(const struct dc_fsm_guard *guard = info->guards; guard && guard->from_id != DC_FSM_IGNORE; guard++)
+    {
+        if(guard->from_id == from_id && guard->to_id == to_id && guard->guard)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static struct dc_fsm_guard_stats *fsm_guard_stats(const struct dc_fsm_info *info, dc_fsm_guard_func guard)
+{
+    for(size_t i = 0; i < info->guard_stats_count; i++)
+    {
+        if(info->guard_stats[i].guard == guard)
+        {
+            return &info->guard_stats[i];
+        }
     }
 
     return NULL;
 }
+
+// the chance a guard passes in parts per FSM_SELECTIVITY_SCALE, starting at even odds for guards that have not been
+// evaluated yet
+static size_t fsm_guard_selectivity(const struct dc_fsm_info *info, dc_fsm_guard_func guard)
+{
+    const struct dc_fsm_guard_stats *stats;
+
+    stats = fsm_guard_stats(info, guard);
+
+    if(stats == NULL)
+    {
+        return FSM_SELECTIVITY_SCALE / 2;
+    }
+
+    return (stats->passes + 1) * FSM_SELECTIVITY_SCALE / (stats->evaluations + 2);
+}
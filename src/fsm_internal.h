@@ -0,0 +1,137 @@
+#ifndef LIBDC_FSM_FSM_INTERNAL_H
+#define LIBDC_FSM_FSM_INTERNAL_H
+
+
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dc_fsm/fsm.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+
+struct fsm_async_ring;
+struct fsm_shm_slot;
+
+// the from state id is kept in the high half of state and the current state id in the low half, so both can be
+// read at once from another process
+struct fsm_runtime
+{
+    _Atomic uint64_t state;
+    _Atomic uint64_t transitions;
+};
+
+enum fsm_notification
+{
+    FSM_WILL_CHANGE_STATE,
+    FSM_DID_CHANGE_STATE,
+    FSM_BAD_CHANGE_STATE,
+};
+
+struct dc_fsm_info
+{
+    char                *name;
+    size_t               name_length;
+    struct fsm_runtime   local;
+    struct fsm_runtime  *runtime;
+    struct fsm_shm_slot *shm_slot;
+
+    void (*will_change_state)(const struct dc_env *env,
+                              struct dc_error           *err,
+                              const struct dc_fsm_info  *info,
+                              int                        from_state_id,
+                              int                        to_state_id);
+
+    void (*did_change_state)(const struct dc_env *env,
+                             struct dc_error           *err,
+                             const struct dc_fsm_info  *info,
+                             int                        from_state_id,
+                             int                        to_state_id,
+                             int                        next_id);
+
+    void (*bad_change_state)(const struct dc_env *env,
+                             struct dc_error           *err,
+                             const struct dc_fsm_info  *info,
+                             int                        from_state_id,
+                             int                        to_state_id);
+
+    struct fsm_async_ring *async_ring;
+
+    const struct dc_fsm_guard *guards;
+    struct dc_fsm_guard_stats *guard_stats;
+    size_t                     guard_stats_count;
+    bool                       order_guards;
+};
+
+static inline uint64_t fsm_pack_state(int from_state_id, int current_state_id)
+{
+    return (uint64_t)(uint32_t)from_state_id << 32U | (uint32_t)current_state_id;
+}
+
+static inline int fsm_get_from_state_id(const struct dc_fsm_info *info)
+{
+    return (int32_t)(uint32_t)(atomic_load_explicit(&info->runtime->state, memory_order_relaxed) >> 32U);
+}
+
+static inline int fsm_get_current_state_id(const struct dc_fsm_info *info)
+{
+    return (int32_t)(uint32_t)atomic_load_explicit(&info->runtime->state, memory_order_relaxed);
+}
+
+static inline void fsm_set_state(struct dc_fsm_info *info, int from_state_id, int current_state_id)
+{
+    atomic_store_explicit(&info->runtime->state, fsm_pack_state(from_state_id, current_state_id), memory_order_release);
+}
+
+static inline void fsm_set_current_state(struct dc_fsm_info *info, int current_state_id)
+{
+    fsm_set_state(info, fsm_get_from_state_id(info), current_state_id);
+}
+
+// only the owner of info writes the counter, so it does not need a locked increment
+static inline void fsm_count_transition(struct dc_fsm_info *info)
+{
+    atomic_store_explicit(&info->runtime->transitions,
+                          atomic_load_explicit(&info->runtime->transitions, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+// call the matching notifier if it is set, or queue it when info is attached to a dc_fsm_async
+void fsm_will_change_state(const struct dc_env *env,
+                           struct dc_error     *err,
+                           struct dc_fsm_info  *info,
+                           int                  from_state_id,
+                           int                  to_state_id);
+void fsm_did_change_state(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          int                  from_state_id,
+                          int                  to_state_id,
+                          int                  next_id);
+void fsm_bad_change_state(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          int                  from_state_id,
+                          int                  to_state_id);
+
+void fsm_async_push(
+    struct fsm_async_ring *ring, enum fsm_notification kind, int from_state_id, int to_state_id, int next_id);
+void fsm_async_detach(const struct dc_env *env, struct dc_fsm_info *info);
+void fsm_shm_detach(struct dc_fsm_info *info);
+
+
+#endif // LIBDC_FSM_FSM_INTERNAL_H
@@ -0,0 +1,484 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dc_fsm/shm.h"
+#include "fsm_internal.h"
+#include <dc_c/dc_stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define SHM_MAGIC 0x6463666DU    // "dcfm"
+#define SHM_VERSION 2U
+#define SHM_HEADER_SIZE 64U
+#define SHM_CACHE_LINE 64
+#define SHM_SNAPSHOT_RETRIES 8
+#define SHM_OPEN_RETRIES 1000
+#define SHM_OPEN_WAIT_NSEC 1000000L
+
+
+struct fsm_shm_header
+{
+    _Atomic uint32_t magic;
+    uint32_t         version;
+    uint64_t         slot_count;
+    uint64_t         slot_size;
+};
+
+// each slot gets its own cache lines so machines in different processes do not share them; owner is the pid, or the
+// negated pid while that process is filling the slot in, and generation is odd while the slot is being rewritten
+struct fsm_shm_slot
+{
+    _Alignas(SHM_CACHE_LINE) _Atomic int32_t owner;
+    _Atomic uint32_t                         generation;
+    struct fsm_runtime                       runtime;
+    char                                     name[DC_FSM_SHM_NAME_LENGTH];
+};
+
+struct dc_fsm_shm
+{
+    struct fsm_shm_header *header;
+    struct fsm_shm_slot   *slots;
+    size_t                 slot_count;
+    size_t                 size;
+};
+
+_Static_assert(sizeof(struct fsm_shm_header) <= SHM_HEADER_SIZE, "the shared memory header does not fit");
+
+static int  shm_map(
+    const struct dc_env *env, struct dc_error *err, struct dc_fsm_shm *shm, int fd, size_t slot_count, bool creator);
+static bool shm_read_slot(const struct fsm_shm_slot *slot, struct dc_fsm_shm_entry *entry);
+static bool shm_owner_is_alive(int32_t owner);
+static void shm_claim(struct dc_fsm_info *info, struct fsm_shm_slot *slot, bool keep_state);
+static void shm_write_begin(struct fsm_shm_slot *slot);
+static void shm_write_end(struct fsm_shm_slot *slot);
+static void shm_wait(void);
+
+struct dc_fsm_shm *dc_fsm_shm_open(const struct dc_env *env, struct dc_error *err, const char *path, size_t slot_count)
+{
+    struct dc_fsm_shm *shm;
+    bool               creator;
+    int                fd;
+
+    DC_TRACE(env);
+    creator = true;
+    fd      = shm_open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);    // NOLINT(hicpp-signed-bitwise)
+
+    if(fd == -1 && errno == EEXIST)
+    {
+        creator = false;
+        fd      = shm_open(path, O_RDWR, 0);
+    }
+
+    if(fd == -1)
+    {
+        DC_ERROR_RAISE_ERRNO(err, errno);
+
+        return NULL;
+    }
+
+    shm = dc_calloc(env, err, 1, sizeof(struct dc_fsm_shm));
+
+    if(dc_error_has_no_error(err) && shm_map(env, err, shm, fd, slot_count, creator) == -1)
+    {
+        dc_free(env, shm);
+        shm = NULL;
+    }
+
+    close(fd);
+
+    return shm;
+}
+
+void dc_fsm_shm_close(const struct dc_env *env, struct dc_fsm_shm **pshm)
+{
+    struct dc_fsm_shm *shm;
+
+    DC_TRACE(env);
+    shm = *pshm;
+    munmap(shm->header, shm->size);
+    dc_free(env, shm);
+    *pshm = NULL;
+}
+
+int dc_fsm_shm_unlink(const struct dc_env *env, struct dc_error *err, const char *path)
+{
+    DC_TRACE(env);
+
+    if(shm_unlink(path) == -1)
+    {
+        DC_ERROR_RAISE_ERRNO(err, errno);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t dc_fsm_shm_get_slot_count(const struct dc_fsm_shm *shm)
+{
+    return shm->slot_count;
+}
+
+size_t dc_fsm_shm_snapshot(const struct dc_fsm_shm *shm, struct dc_fsm_shm_entry entries[], size_t max_entries)
+{
+    size_t count;
+
+    count = 0;
+
+    for(size_t i = 0; i < shm->slot_count && count < max_entries; i++)
+    {
+        entries[count].slot = i;
+
+        if(shm_read_slot(&shm->slots[i], &entries[count]))
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+ssize_t dc_fsm_info_attach_shm(const struct dc_env *env,
+                               struct dc_error     *err,
+                               struct dc_fsm_info  *info,
+                               struct dc_fsm_shm   *shm)
+{
+    DC_TRACE(env);
+
+    if(info->shm_slot)
+    {
+        fsm_shm_detach(info);
+    }
+
+    for(size_t i = 0; i < shm->slot_count; i++)
+    {
+        int32_t expected;
+
+        expected = 0;
+
+        if(atomic_compare_exchange_strong(&shm->slots[i].owner, &expected, -(int32_t)getpid()))
+        {
+            shm_claim(info, &shm->slots[i], false);
+
+            return (ssize_t)i;
+        }
+    }
+
+    DC_ERROR_RAISE_USER(err, "No free shared memory slot", 1);
+
+    return -1;
+}
+
+int dc_fsm_info_adopt_shm(const struct dc_env *env,
+                          struct dc_error     *err,
+                          struct dc_fsm_info  *info,
+                          struct dc_fsm_shm   *shm,
+                          size_t               slot)
+{
+    int32_t owner;
+    bool    keep_state;
+
+    DC_TRACE(env);
+
+    if(slot >= shm->slot_count)
+    {
+        DC_ERROR_RAISE_USER(err, "Shared memory slot out of range", 1);
+
+        return -1;
+    }
+
+    owner = atomic_load_explicit(&shm->slots[slot].owner, memory_order_acquire);
+
+    // a failed exchange reloads owner, so another process adopting the slot at the same time is checked again
+    do
+    {
+        if(shm_owner_is_alive(owner))
+        {
+            DC_ERROR_RAISE_USER(err, "Shared memory slot is owned by a running process", 1);
+
+            return -1;
+        }
+    } while(!atomic_compare_exchange_strong(&shm->slots[slot].owner, &owner, -(int32_t)getpid()));
+
+    // a claimer that died part way through never finished writing the state
+    keep_state = owner > 0;
+
+    if(info->shm_slot)
+    {
+        fsm_shm_detach(info);
+    }
+
+    shm_claim(info, &shm->slots[slot], keep_state);
+
+    return 0;
+}
+
+void dc_fsm_info_detach_shm(const struct dc_env *env, struct dc_fsm_info *info)
+{
+    DC_TRACE(env);
+
+    if(info->shm_slot)
+    {
+        fsm_shm_detach(info);
+    }
+}
+
+void fsm_shm_detach(struct dc_fsm_info *info)
+{
+    struct fsm_shm_slot *slot;
+
+    slot = info->shm_slot;
+    atomic_store_explicit(&info->local.state,
+                          atomic_load_explicit(&slot->runtime.state, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&info->local.transitions,
+                          atomic_load_explicit(&slot->runtime.transitions, memory_order_relaxed),
+                          memory_order_relaxed);
+    info->runtime  = &info->local;
+    info->shm_slot = NULL;
+
+    // only the process holding owner writes the generation, so the slot is released without touching it; the next
+    // claimer's write section is what tells a reader that was copying this machine to try again
+    atomic_store_explicit(&slot->owner, 0, memory_order_release);
+}
+
+static int shm_map(const struct dc_env *env,
+                   struct dc_error     *err,
+                   struct dc_fsm_shm   *shm,
+                   int                  fd,
+                   size_t               slot_count,
+                   bool                 creator)
+{
+    struct stat status;
+    void       *map;
+
+    DC_TRACE(env);
+
+    if(creator)
+    {
+        status.st_size = (off_t)(SHM_HEADER_SIZE + slot_count * sizeof(struct fsm_shm_slot));
+
+        if(ftruncate(fd, status.st_size) == -1)
+        {
+            DC_ERROR_RAISE_ERRNO(err, errno);
+
+            return -1;
+        }
+    }
+    else
+    {
+        // the creator may not have sized the segment yet
+        for(int i = 0; i < SHM_OPEN_RETRIES; i++)
+        {
+            if(fstat(fd, &status) == -1)
+            {
+                DC_ERROR_RAISE_ERRNO(err, errno);
+
+                return -1;
+            }
+
+            if((size_t)status.st_size >= SHM_HEADER_SIZE)
+            {
+                break;
+            }
+
+            shm_wait();
+        }
+    }
+
+    if((size_t)status.st_size < SHM_HEADER_SIZE)
+    {
+        DC_ERROR_RAISE_USER(err, "Shared memory segment was never initialised", 1);
+
+        return -1;
+    }
+
+    map = mmap(NULL,
+               (size_t)status.st_size,
+               PROT_READ | PROT_WRITE,    // NOLINT(hicpp-signed-bitwise)
+               MAP_SHARED,
+               fd,
+               0);
+
+    if(map == MAP_FAILED)
+    {
+        DC_ERROR_RAISE_ERRNO(err, errno);
+
+        return -1;
+    }
+
+    shm->header = map;
+    shm->slots  = (struct fsm_shm_slot *)((char *)map + SHM_HEADER_SIZE);
+    shm->size   = (size_t)status.st_size;
+
+    if(creator)
+    {
+        shm->header->version    = SHM_VERSION;
+        shm->header->slot_count = slot_count;
+        shm->header->slot_size  = sizeof(struct fsm_shm_slot);
+        atomic_store_explicit(&shm->header->magic, SHM_MAGIC, memory_order_release);
+    }
+    else
+    {
+        for(int i = 0;
+            i < SHM_OPEN_RETRIES && atomic_load_explicit(&shm->header->magic, memory_order_acquire) != SHM_MAGIC;
+            i++)
+        {
+            shm_wait();
+        }
+
+        if(atomic_load_explicit(&shm->header->magic, memory_order_acquire) != SHM_MAGIC ||
+           shm->header->version != SHM_VERSION || shm->header->slot_size != sizeof(struct fsm_shm_slot) ||
+           shm->size < SHM_HEADER_SIZE + shm->header->slot_count * sizeof(struct fsm_shm_slot))
+        {
+            munmap(map, shm->size);
+            DC_ERROR_RAISE_USER(err, "Shared memory segment is not a compatible dc_fsm segment", 1);
+
+            return -1;
+        }
+    }
+
+    shm->slot_count = shm->header->slot_count;
+
+    return 0;
+}
+
+// a copy that overlaps a claim or detach is retried, and the slot is skipped if it keeps changing
+static bool shm_read_slot(const struct fsm_shm_slot *slot, struct dc_fsm_shm_entry *entry)
+{
+    for(int i = 0; i < SHM_SNAPSHOT_RETRIES; i++)
+    {
+        uint32_t generation;
+        int32_t  owner;
+        uint64_t state;
+
+        generation = atomic_load_explicit(&slot->generation, memory_order_acquire);
+
+        if(generation & 1U)
+        {
+            continue;
+        }
+
+        owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+
+        if(owner <= 0)
+        {
+            return false;
+        }
+
+        state                   = atomic_load_explicit(&slot->runtime.state, memory_order_relaxed);
+        entry->owner            = (pid_t)owner;
+        entry->from_state_id    = (int32_t)(uint32_t)(state >> 32U);
+        entry->current_state_id = (int32_t)(uint32_t)state;
+        entry->transitions      = atomic_load_explicit(&slot->runtime.transitions, memory_order_relaxed);
+        memcpy(entry->name, slot->name, sizeof(entry->name));
+        atomic_thread_fence(memory_order_acquire);
+
+        if(atomic_load_explicit(&slot->generation, memory_order_relaxed) == generation)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool shm_owner_is_alive(int32_t owner)
+{
+    pid_t pid;
+
+    if(owner == 0)
+    {
+        return false;
+    }
+
+    // a negative owner is a process that has not finished claiming the slot
+    pid = owner < 0 ? (pid_t)-owner : (pid_t)owner;
+
+    if(pid == getpid())
+    {
+        return true;
+    }
+
+    // EPERM means the process exists but belongs to someone else
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void shm_claim(struct dc_fsm_info *info, struct fsm_shm_slot *slot, bool keep_state)
+{
+    size_t length;
+
+    shm_write_begin(slot);
+
+    if(!keep_state)
+    {
+        atomic_store_explicit(&slot->runtime.state,
+                              atomic_load_explicit(&info->runtime->state, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(&slot->runtime.transitions,
+                              atomic_load_explicit(&info->runtime->transitions, memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+
+    length = info->name_length < DC_FSM_SHM_NAME_LENGTH ? info->name_length : DC_FSM_SHM_NAME_LENGTH;
+    memset(slot->name, 0, sizeof(slot->name));
+    memcpy(slot->name, info->name, length - 1);
+    info->runtime  = &slot->runtime;
+    info->shm_slot = slot;
+    atomic_store_explicit(&slot->owner, (int32_t)getpid(), memory_order_relaxed);
+    shm_write_end(slot);
+}
+
+static void shm_write_begin(struct fsm_shm_slot *slot)
+{
+    uint32_t generation;
+
+    // a claimer that died part way leaves the generation odd, and the process that adopts the slot carries on from
+    // there; no one else can be writing, as only the process holding owner touches the generation
+    generation = atomic_load_explicit(&slot->generation, memory_order_relaxed);
+
+    if((generation & 1U) == 0)
+    {
+        atomic_store_explicit(&slot->generation, generation + 1, memory_order_relaxed);
+    }
+
+    atomic_thread_fence(memory_order_release);
+}
+
+static void shm_write_end(struct fsm_shm_slot *slot)
+{
+    atomic_store_explicit(&slot->generation,
+                          atomic_load_explicit(&slot->generation, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+static void shm_wait(void)
+{
+    struct timespec wait;
+
+    wait.tv_sec  = 0;
+    wait.tv_nsec = SHM_OPEN_WAIT_NSEC;
+    nanosleep(&wait, NULL);
+}
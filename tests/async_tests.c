@@ -0,0 +1,310 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tests.h"
+#include <dc_env/env.h>
+#include <dc_error/error.h>
+#include <dc_fsm/async.h>
+#include <dc_fsm/fsm.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+
+#define ASYNC_TEST_CAPACITY 64
+#define ASYNC_TEST_STEPS 10
+
+enum async_test_states
+{
+    PING = DC_FSM_USER_START,    // 2
+    PONG,                        // 3
+};
+
+static int async_test_ping(const struct dc_env *env, struct dc_error *err, void *arg);
+static int async_test_pong(const struct dc_env *env, struct dc_error *err, void *arg);
+static void async_test_run(struct dc_fsm_info *info);
+static void async_test_wait_for_runs(void);
+static void async_test_check_stats(void);
+static void async_test_destroy(const struct dc_env *env,
+                               struct dc_error *err,
+                               const struct dc_fsm_info *info,
+                               int from_state_id,
+                               int to_state_id,
+                               int next_id);
+static void async_test_detach(const struct dc_env *env,
+                              struct dc_error *err,
+                              const struct dc_fsm_info *info,
+                              int from_state_id,
+                              int to_state_id,
+                              int next_id);
+static void async_test_flush(const struct dc_env *env,
+                             struct dc_error *err,
+                             const struct dc_fsm_info *info,
+                             int from_state_id,
+                             int to_state_id,
+                             int next_id);
+
+static const struct dc_fsm_transition transitions[] = {
+    {DC_FSM_INIT, PING, async_test_ping},
+    {PING, PONG, async_test_pong},
+    {PONG, PING, async_test_ping},
+    {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
+};
+
+static struct dc_error     *test_err;
+static struct dc_error     *test_notifier_err;
+static struct dc_env       *test_env;
+static struct dc_fsm_async *test_async;
+static struct dc_fsm_info  *test_machines[2];
+static int                  test_last_state_ids[2];
+static size_t               test_notified;
+static size_t               test_out_of_order;
+static atomic_bool          test_runs_finished;
+
+Describe(async);
+
+BeforeEach(async)
+{
+    test_err               = dc_error_create(false);
+    test_notifier_err      = dc_error_create(false);
+    test_env               = dc_env_create(test_err, false, NULL);
+    test_machines[0]       = dc_fsm_info_create(test_env, test_err, "first");
+    test_machines[1]       = dc_fsm_info_create(test_env, test_err, "second");
+    test_last_state_ids[0] = DC_FSM_INIT;
+    test_last_state_ids[1] = DC_FSM_INIT;
+    test_notified          = 0;
+    test_out_of_order      = 0;
+    atomic_store(&test_runs_finished, false);
+
+    // the notifiers hold up the background thread until the machines have finished, so nothing may block
+    test_async = dc_fsm_async_create(test_env, test_err, test_notifier_err, ASYNC_TEST_CAPACITY, DC_FSM_ASYNC_DROP);
+}
+
+AfterEach(async)
+{
+    dc_fsm_async_destroy(test_env, &test_async);
+
+    for(size_t i = 0; i < 2; i++)
+    {
+        if(test_machines[i])
+        {
+            dc_fsm_info_destroy(test_env, &test_machines[i]);
+        }
+    }
+
+    free(test_env);
+    free(test_notifier_err);
+    free(test_err);
+}
+
+Ensure(async, a_notifier_can_destroy_its_own_machine)
+{
+    struct dc_fsm_async_stats stats;
+
+    dc_fsm_info_set_did_change_state(test_machines[0], async_test_destroy);
+    assert_that(dc_fsm_info_set_async(test_env, test_err, test_machines[0], test_async), is_equal_to(0));
+    async_test_run(test_machines[0]);
+    atomic_store(&test_runs_finished, true);
+    dc_fsm_async_flush(test_env, test_async);
+
+    // the first notification destroyed the machine, which dropped the rest of its buffer
+    assert_that(test_machines[0], is_null);
+    assert_that(test_notified, is_equal_to(1));
+    dc_fsm_async_get_stats(test_async, &stats);
+    assert_that(stats.delivered, is_equal_to(1));
+    assert_that(stats.dropped, is_not_equal_to(0));
+    async_test_check_stats();
+}
+
+Ensure(async, a_notifier_can_detach_its_own_machine)
+{
+    size_t notified;
+
+    dc_fsm_info_set_did_change_state(test_machines[0], async_test_detach);
+    assert_that(dc_fsm_info_set_async(test_env, test_err, test_machines[0], test_async), is_equal_to(0));
+    async_test_run(test_machines[0]);
+    atomic_store(&test_runs_finished, true);
+    dc_fsm_async_flush(test_env, test_async);
+    assert_that(test_notified, is_equal_to(1));
+    async_test_check_stats();
+
+    // once detached the notifiers are called from dc_fsm_run again
+    notified = test_notified;
+    async_test_run(test_machines[0]);
+    assert_that(test_notified, is_not_equal_to(notified));
+}
+
+Ensure(async, a_notifier_can_flush)
+{
+    struct dc_fsm_async_stats stats;
+
+    for(size_t i = 0; i < 2; i++)
+    {
+        dc_fsm_info_set_did_change_state(test_machines[i], async_test_flush);
+        assert_that(dc_fsm_info_set_async(test_env, test_err, test_machines[i], test_async), is_equal_to(0));
+    }
+
+    async_test_run(test_machines[0]);
+    async_test_run(test_machines[1]);
+    atomic_store(&test_runs_finished, true);
+    dc_fsm_async_flush(test_env, test_async);
+
+    // the first notifier flushed the other machine from inside its batch without reordering either of them
+    dc_fsm_async_get_stats(test_async, &stats);
+    assert_that(stats.dropped, is_equal_to(0));
+    assert_that(test_notified, is_equal_to(stats.delivered));
+    assert_that(test_out_of_order, is_equal_to(0));
+    async_test_check_stats();
+}
+
+TestSuite *async_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, async, a_notifier_can_destroy_its_own_machine);
+    add_test_with_context(suite, async, a_notifier_can_detach_its_own_machine);
+    add_test_with_context(suite, async, a_notifier_can_flush);
+
+    return suite;
+}
+
+static int async_test_ping(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    int *counter;
+
+    DC_TRACE(env);
+    (void)err;
+    counter = arg;
+    (*counter)--;
+
+    return *counter > 0 ? PONG : DC_FSM_EXIT;
+}
+
+static int async_test_pong(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    int *counter;
+
+    DC_TRACE(env);
+    (void)err;
+    counter = arg;
+    (*counter)--;
+
+    return *counter > 0 ? PING : DC_FSM_EXIT;
+}
+
+static void async_test_run(struct dc_fsm_info *info)
+{
+    int from_state_id;
+    int to_state_id;
+    int counter;
+
+    counter = ASYNC_TEST_STEPS;
+    assert_that(dc_fsm_run(test_env, test_err, info, &from_state_id, &to_state_id, &counter, transitions),
+                is_equal_to(0));
+}
+
+// the buffers have to fill up before the notifiers do anything, or there would be nothing left to drop or flush
+static void async_test_wait_for_runs(void)
+{
+    while(!atomic_load(&test_runs_finished))
+    {
+        sched_yield();
+    }
+}
+
+static void async_test_check_stats(void)
+{
+    struct dc_fsm_async_stats stats;
+
+    dc_fsm_async_get_stats(test_async, &stats);
+    assert_that(stats.enqueued, is_not_equal_to(0));
+    assert_that(stats.enqueued, is_equal_to(stats.delivered + stats.dropped));
+}
+
+static void async_test_destroy(const struct dc_env *env,
+                               struct dc_error *err,
+                               const struct dc_fsm_info *info,
+                               int from_state_id,
+                               int to_state_id,
+                               int next_id)
+{
+    DC_TRACE(env);
+    (void)err;
+    (void)info;
+    (void)from_state_id;
+    (void)to_state_id;
+    (void)next_id;
+    async_test_wait_for_runs();
+    test_notified++;
+
+    if(test_machines[0])
+    {
+        dc_fsm_info_destroy(env, &test_machines[0]);
+    }
+}
+
+static void async_test_detach(const struct dc_env *env,
+                              struct dc_error *err,
+                              const struct dc_fsm_info *info,
+                              int from_state_id,
+                              int to_state_id,
+                              int next_id)
+{
+    DC_TRACE(env);
+    (void)info;
+    (void)from_state_id;
+    (void)to_state_id;
+    (void)next_id;
+    async_test_wait_for_runs();
+
+    if(test_notified == 0)
+    {
+        dc_fsm_info_set_async(env, err, test_machines[0], NULL);
+    }
+
+    test_notified++;
+}
+
+static void async_test_flush(const struct dc_env *env,
+                             struct dc_error *err,
+                             const struct dc_fsm_info *info,
+                             int from_state_id,
+                             int to_state_id,
+                             int next_id)
+{
+    size_t machine;
+
+    DC_TRACE(env);
+    (void)err;
+    (void)next_id;
+    async_test_wait_for_runs();
+    machine = info == test_machines[0] ? 0 : 1;
+
+    if(from_state_id != test_last_state_ids[machine])
+    {
+        test_out_of_order++;
+    }
+
+    test_last_state_ids[machine] = to_state_id;
+    test_notified++;
+
+    if(test_notified == 1)
+    {
+        dc_fsm_async_flush(env, test_async);
+    }
+}
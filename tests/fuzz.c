@@ -0,0 +1,1562 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Builds a random transition table and a random sequence of next ids from each input, runs it through dc_fsm_run
+// and the DFA engine, and checks both against a plain reference loop. Built with DC_FSM_LIBFUZZER defined this is
+// a libFuzzer target; otherwise main replays the files it is given (for AFL use @@) or generates inputs on any
+// number of threads and reports execs/sec.
+
+
+#include <dc_env/env.h>
+#include <dc_error/error.h>
+#include <dc_fsm/async.h>
+#include <dc_fsm/dfa.h>
+#include <dc_fsm/fsm.h>
+#include <dc_fsm/shm.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define FUZZ_MAX_STATES 8
+#define FUZZ_MAX_TRANSITIONS 48
+#define FUZZ_MAX_STEPS 256
+#define FUZZ_FUNCTION_COUNT 4
+#define FUZZ_MAX_DFA_STATES 40    // more than the 16 lanes of the shuffle kernel, so the scalar summary runs too
+#define FUZZ_MAX_CLASSES 4
+#define FUZZ_MAX_CLASS_WIDTH 64
+#define FUZZ_UNKNOWN_ID 1000
+#define FUZZ_PARALLEL_LENGTH (192 * 1024)
+#define FUZZ_PARALLEL_THREADS 4
+#define FUZZ_TAIL_LENGTH 64
+#define FUZZ_FNV_OFFSET 0xcbf29ce484222325ULL
+#define FUZZ_FNV_PRIME 0x100000001b3ULL
+#define FUZZ_EXCLUSIVE_GUARDS 0x01U
+#define FUZZ_PARALLEL_MASK 0x1EU
+#define FUZZ_RARE_BYTE_ODDS 2048
+
+
+// the bytes of one input, read front to back, with zeros once they run out
+struct fuzz_input
+{
+    const uint8_t *data;
+    size_t         size;
+    size_t         position;
+};
+
+// everything a run did, as seen by the notifiers, state functions, and guards
+struct fuzz_trace
+{
+    uint64_t hash;
+    size_t   events;
+    size_t   guard_calls;
+};
+
+// the arg of every state function; each run gets a fresh copy so the real and reference runs make the same choices
+struct fuzz_run
+{
+    struct fuzz_input choices;
+    uint64_t          seed;
+    size_t            steps;
+    size_t            state_count;
+    bool              exclusive_guards;
+};
+
+struct fuzz_dfa
+{
+    struct dc_fsm_dfa_class             classes[FUZZ_MAX_CLASSES + 1];
+    struct dc_fsm_dfa_transition        transitions[FUZZ_MAX_DFA_STATES * (FUZZ_MAX_CLASSES + 1) + 1];
+    int                                 class_map[UINT8_MAX + 1];
+    const struct dc_fsm_dfa_transition *lookup[FUZZ_MAX_DFA_STATES + 1][FUZZ_MAX_CLASSES + 1];
+    size_t                              state_count;
+};
+
+struct fuzz_dfa_state
+{
+    int from_id;
+    int current_id;
+};
+
+struct fuzz_worker
+{
+    const struct dc_env *env;
+    uint64_t             seed;
+    size_t               iterations;
+    pthread_t            thread;
+};
+
+static void     fuzz_one(const struct dc_env *env, struct dc_error *err, const uint8_t *data, size_t size);
+static void     fuzz_fsm(const struct dc_env *env, struct dc_error *err, struct fuzz_input *input, uint8_t flags);
+static void     fuzz_dfa(const struct dc_env *env, struct dc_error *err, struct fuzz_input *input, uint8_t flags);
+static int      fuzz_reference_run(struct fuzz_run                *run,
+                                   const struct dc_fsm_transition  transitions[],
+                                   const struct dc_fsm_guard       guard_table[],
+                                   int                            *pfrom_id,
+                                   int                            *pto_id);
+static int      fuzz_reference_route(struct fuzz_run                *run,
+                                     const struct dc_fsm_transition  transitions[],
+                                     const struct dc_fsm_guard       guard_table[],
+                                     int                             from_id);
+static int      fuzz_reference_scan(struct fuzz_run       *run,
+                                    const struct fuzz_dfa *dfa,
+                                    struct fuzz_dfa_state *state,
+                                    const uint8_t         *data,
+                                    size_t                 length,
+                                    size_t                *consumed);
+static int      fuzz_dfa_index(const struct fuzz_dfa *dfa, int state_id);
+static int      fuzz_choose_state(struct fuzz_run *run);
+static int      fuzz_choose_action(struct fuzz_run *run);
+static bool     fuzz_guard(void *arg, size_t index);
+static int      fuzz_perform(void *arg, size_t index);
+static int      fuzz_action(void *arg, size_t index);
+static int      fuzz_perform_0(const struct dc_env *env, struct dc_error *err, void *arg);
+static int      fuzz_perform_1(const struct dc_env *env, struct dc_error *err, void *arg);
+static int      fuzz_perform_2(const struct dc_env *env, struct dc_error *err, void *arg);
+static int      fuzz_perform_3(const struct dc_env *env, struct dc_error *err, void *arg);
+static bool     fuzz_guard_0(const struct dc_env *env, struct dc_error *err, void *arg);
+static bool     fuzz_guard_1(const struct dc_env *env, struct dc_error *err, void *arg);
+static bool     fuzz_guard_2(const struct dc_env *env, struct dc_error *err, void *arg);
+static bool     fuzz_guard_3(const struct dc_env *env, struct dc_error *err, void *arg);
+static int      fuzz_action_0(const struct dc_env *env, struct dc_error *err, void *arg);
+static int      fuzz_action_1(const struct dc_env *env, struct dc_error *err, void *arg);
+static void     fuzz_will_change_state(const struct dc_env      *env,
+                                       struct dc_error          *err,
+                                       const struct dc_fsm_info *info,
+                                       int                       from_state_id,
+                                       int                       to_state_id);
+static void     fuzz_did_change_state(const struct dc_env      *env,
+                                      struct dc_error          *err,
+                                      const struct dc_fsm_info *info,
+                                      int                       from_state_id,
+                                      int                       to_state_id,
+                                      int                       next_id);
+static void     fuzz_bad_change_state(const struct dc_env      *env,
+                                      struct dc_error          *err,
+                                      const struct dc_fsm_info *info,
+                                      int                       from_state_id,
+                                      int                       to_state_id);
+static struct dc_fsm_info *fuzz_info_create(const struct dc_env *env, struct dc_error *err);
+static void     fuzz_record(char kind, int first, int second, size_t third);
+static void     fuzz_check(bool condition, const char *what);
+static uint8_t  fuzz_byte(struct fuzz_input *input);
+static uint64_t fuzz_hash(const uint8_t *data, size_t size);
+static uint64_t fuzz_mix(uint64_t value);
+static uint64_t fuzz_random(uint64_t *state);
+
+// where the notifiers, state functions, and guards of the run on this thread record what they see
+static _Thread_local struct fuzz_trace *current_trace;
+
+static const dc_fsm_state_func performs[FUZZ_FUNCTION_COUNT] = {
+    fuzz_perform_0,
+    fuzz_perform_1,
+    fuzz_perform_2,
+    fuzz_perform_3,
+};
+
+static const dc_fsm_guard_func guards[FUZZ_FUNCTION_COUNT] = {
+    fuzz_guard_0,
+    fuzz_guard_1,
+    fuzz_guard_2,
+    fuzz_guard_3,
+};
+
+static const dc_fsm_state_func actions[] = {
+    fuzz_action_0,
+    fuzz_action_1,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct dc_error *err;
+    static struct dc_env   *env;
+
+    if(env == NULL)
+    {
+        err = dc_error_create(false);
+        env = dc_env_create(err, false, NULL);
+    }
+
+    fuzz_one(env, err, data, size);
+
+    return 0;
+}
+
+#ifndef DC_FSM_LIBFUZZER
+
+#define FUZZ_MAX_INPUT 1024
+#define FUZZ_DEFAULT_ITERATIONS 10000
+#define NSEC_PER_SEC 1000000000L
+#define FUZZ_ASYNC_CAPACITY 8    // small enough that runs wrap around the buffer, and overflow it under DROP
+#define FUZZ_ASYNC_ODDS 8
+#define FUZZ_SHM_ODDS 8
+#define FUZZ_SHM_PATH_LENGTH 64
+
+// one dc_fsm_async per policy, shared by the machines of every worker, and what their notifiers saw
+struct fuzz_async
+{
+    struct dc_fsm_async *async;
+    struct dc_error     *notifier_err;
+    atomic_size_t        produced;
+    atomic_size_t        notified;
+};
+
+static void *fuzz_work(void *arg);
+static int   fuzz_replay(const struct dc_env *env, struct dc_error *err, const char *path);
+static void  fuzz_async_create(const struct dc_env *env, struct dc_error *err);
+static void  fuzz_async_run(const struct dc_env *env, struct dc_error *err, uint64_t *random);
+static void  fuzz_async_check(const struct dc_env *env);
+static void  fuzz_async_will_change_state(const struct dc_env      *env,
+                                          struct dc_error          *err,
+                                          const struct dc_fsm_info *info,
+                                          int                       from_state_id,
+                                          int                       to_state_id);
+static void  fuzz_async_did_change_state(const struct dc_env      *env,
+                                         struct dc_error          *err,
+                                         const struct dc_fsm_info *info,
+                                         int                       from_state_id,
+                                         int                       to_state_id,
+                                         int                       next_id);
+static void  fuzz_async_count(const struct dc_fsm_info *info);
+static void  fuzz_shm_open(const struct dc_env *env, struct dc_error *err, size_t slot_count);
+static void  fuzz_shm_run(const struct dc_env *env, struct dc_error *err, uint64_t *random);
+static void  fuzz_shm_check_snapshot(const struct dc_fsm_info *info, size_t steps);
+static void  fuzz_shm_close(const struct dc_env *env, struct dc_error *err);
+static int   fuzz_countdown(const struct dc_env *env, struct dc_error *err, void *arg);
+
+static struct fuzz_async  fuzz_asyncs[DC_FSM_ASYNC_BLOCK + 1];
+static const char *const  fuzz_async_names[DC_FSM_ASYNC_BLOCK + 1] = {
+    "drop",
+    "block",
+};
+
+// every worker attaches machines to the same segment while the others take snapshots of it
+static struct dc_fsm_shm *fuzz_shm;
+static char               fuzz_shm_path[FUZZ_SHM_PATH_LENGTH];
+static const char *const  fuzz_shm_names[] = {
+    "s",
+    "shm",
+    "a machine with a name long enough to be cut short",
+};
+
+int main(int argc, char *argv[])
+{
+    struct dc_error    *err;
+    struct dc_env      *env;
+    struct fuzz_worker *workers;
+    struct timespec     start;
+    struct timespec     stop;
+    size_t              iterations;
+    size_t              thread_count;
+    uint64_t            seed;
+    double              elapsed;
+    int                 option;
+    int                 ret_val;
+
+    iterations   = FUZZ_DEFAULT_ITERATIONS;
+    thread_count = 1;
+    seed         = (uint64_t)time(NULL);
+
+    while((option = getopt(argc, argv, "n:t:s:")) != -1)
+    {
+        switch(option)
+        {
+            case 'n':
+            {
+                iterations = strtoull(optarg, NULL, 10);
+                break;
+            }
+            case 't':
+            {
+                thread_count = strtoull(optarg, NULL, 10);
+                break;
+            }
+            case 's':
+            {
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            }
+            default:
+            {
+                fprintf(stderr, "Usage: %s [-n iterations] [-t threads] [-s seed] [input ...]\n", argv[0]);
+
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    err     = dc_error_create(false);
+    env     = dc_env_create(err, false, NULL);
+    ret_val = EXIT_SUCCESS;
+
+    if(optind < argc)
+    {
+        for(int i = optind; i < argc; i++)
+        {
+            if(fuzz_replay(env, err, argv[i]) == -1)
+            {
+                ret_val = EXIT_FAILURE;
+            }
+        }
+
+        free(env);
+        dc_error_reset(err);
+        free(err);
+
+        return ret_val;
+    }
+
+    if(thread_count == 0)
+    {
+        thread_count = 1;
+    }
+
+    workers = calloc(thread_count, sizeof(struct fuzz_worker));
+
+    if(workers == NULL)
+    {
+        perror("calloc");
+
+        return EXIT_FAILURE;
+    }
+
+    printf("seed %llu, %zu threads, %zu iterations each\n", (unsigned long long)seed, thread_count, iterations);
+    fuzz_async_create(env, err);
+    fuzz_shm_open(env, err, thread_count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // every thread runs its own machines, so the library is hammered by many dc_fsm_info at once
+    for(size_t i = 0; i < thread_count; i++)
+    {
+        workers[i].env        = env;
+        workers[i].seed       = fuzz_mix(seed + i);
+        workers[i].iterations = iterations;
+        pthread_create(&workers[i].thread, NULL, fuzz_work, &workers[i]);
+    }
+
+    for(size_t i = 0; i < thread_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / (double)NSEC_PER_SEC;
+    printf("%zu execs in %.3f s (%.0f execs/sec)\n",
+           iterations * thread_count,
+           elapsed,
+           (double)(iterations * thread_count) / elapsed);
+    fuzz_async_check(env);
+    fuzz_shm_close(env, err);
+    free(workers);
+    free(env);
+    dc_error_reset(err);
+    free(err);
+
+    return ret_val;
+}
+
+static void *fuzz_work(void *arg)
+{
+    struct fuzz_worker *worker;
+    struct dc_error    *err;
+    uint8_t             data[FUZZ_MAX_INPUT];
+    uint64_t            state;
+
+    worker = arg;
+    err    = dc_error_create(false);
+    state  = worker->seed | 1U;
+
+    for(size_t i = 0; i < worker->iterations; i++)
+    {
+        size_t size;
+
+        size = (size_t)(fuzz_random(&state) % FUZZ_MAX_INPUT) + 1;
+
+        for(size_t j = 0; j < size; j++)
+        {
+            data[j] = (uint8_t)fuzz_random(&state);
+        }
+
+        fuzz_one(worker->env, err, data, size);
+
+        if(fuzz_random(&state) % FUZZ_ASYNC_ODDS == 0)
+        {
+            fuzz_async_run(worker->env, err, &state);
+        }
+
+        if(fuzz_random(&state) % FUZZ_SHM_ODDS == 0)
+        {
+            fuzz_shm_run(worker->env, err, &state);
+        }
+    }
+
+    dc_error_reset(err);
+    free(err);
+
+    return NULL;
+}
+
+static int fuzz_replay(const struct dc_env *env, struct dc_error *err, const char *path)
+{
+    FILE   *file;
+    uint8_t data[FUZZ_MAX_INPUT];
+    size_t  size;
+
+    file = fopen(path, "rb");
+
+    if(file == NULL)
+    {
+        perror(path);
+
+        return -1;
+    }
+
+    size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    fuzz_one(env, err, data, size);
+
+    return 0;
+}
+
+static void fuzz_async_create(const struct dc_env *env, struct dc_error *err)
+{
+    for(size_t policy = DC_FSM_ASYNC_DROP; policy <= DC_FSM_ASYNC_BLOCK; policy++)
+    {
+        struct fuzz_async *async;
+
+        async               = &fuzz_asyncs[policy];
+        async->notifier_err = dc_error_create(false);
+        async->async        = dc_fsm_async_create(
+            env, err, async->notifier_err, FUZZ_ASYNC_CAPACITY, (dc_fsm_async_policy)policy);
+        fuzz_check(async->async != NULL, "dc_fsm_async_create");
+        atomic_init(&async->produced, 0);
+        atomic_init(&async->notified, 0);
+    }
+}
+
+// a machine that counts its steps through one of the dc_fsm_async, then detaches, or is destroyed while attached
+static void fuzz_async_run(const struct dc_env *env, struct dc_error *err, uint64_t *random)
+{
+    static const struct dc_fsm_transition transitions[] = {
+        {DC_FSM_INIT, DC_FSM_USER_START, fuzz_countdown},
+        {DC_FSM_USER_START, DC_FSM_USER_START, fuzz_countdown},
+        {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
+    };
+    struct fuzz_async  *async;
+    struct dc_fsm_info *info;
+    uint64_t            value;
+    size_t              policy;
+    size_t              steps;
+    size_t              remaining;
+
+    value     = fuzz_random(random);
+    policy    = (size_t)(value & 1U);
+    async     = &fuzz_asyncs[policy];
+    steps     = (size_t)(value >> 8U) % FUZZ_MAX_STEPS + 1;
+    remaining = steps;
+    info      = dc_fsm_info_create(env, err, fuzz_async_names[policy]);
+    fuzz_check(info != NULL, "dc_fsm_info_create");
+    dc_fsm_info_set_will_change_state(info, fuzz_async_will_change_state);
+    dc_fsm_info_set_did_change_state(info, fuzz_async_did_change_state);
+    fuzz_check(dc_fsm_info_set_async(env, err, info, async->async) == 0, "dc_fsm_info_set_async");
+    fuzz_check(dc_fsm_run(env, err, info, NULL, NULL, &remaining, transitions) == 0, "dc_fsm_run with async");
+
+    // every step queues a will and a did change state
+    atomic_fetch_add_explicit(&async->produced, 2 * steps, memory_order_relaxed);
+
+    if(value & 2U)
+    {
+        fuzz_check(dc_fsm_info_set_async(env, err, info, NULL) == 0, "dc_fsm_info_set_async");
+    }
+
+    dc_fsm_info_destroy(env, &info);
+}
+
+// every event a machine queued is delivered or counted as dropped, and blocking never drops
+static void fuzz_async_check(const struct dc_env *env)
+{
+    for(size_t policy = DC_FSM_ASYNC_DROP; policy <= DC_FSM_ASYNC_BLOCK; policy++)
+    {
+        struct fuzz_async        *async;
+        struct dc_fsm_async_stats stats;
+
+        async = &fuzz_asyncs[policy];
+        dc_fsm_async_flush(env, async->async);
+        dc_fsm_async_get_stats(async->async, &stats);
+        printf("async %s: %zu enqueued, %zu delivered, %zu dropped, %zu blocked, %zu batches\n",
+               fuzz_async_names[policy],
+               stats.enqueued,
+               stats.delivered,
+               stats.dropped,
+               stats.blocked,
+               stats.batches);
+        fuzz_check(stats.enqueued == atomic_load(&async->produced), "async enqueued");
+        fuzz_check(stats.delivered == atomic_load(&async->notified), "async delivered");
+        fuzz_check(stats.enqueued == stats.delivered + stats.dropped, "async enqueued, delivered, and dropped");
+        fuzz_check(policy == DC_FSM_ASYNC_DROP || stats.dropped == 0, "async dropped while blocking");
+        dc_fsm_async_destroy(env, &async->async);
+        dc_error_reset(async->notifier_err);
+        free(async->notifier_err);
+    }
+}
+
+static int fuzz_countdown(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    size_t *remaining;
+
+    (void)env;
+    (void)err;
+    remaining = arg;
+    (*remaining)--;
+
+    return *remaining > 0 ? DC_FSM_USER_START : DC_FSM_EXIT;
+}
+
+static void fuzz_async_will_change_state(const struct dc_env      *env,
+                                         struct dc_error          *err,
+                                         const struct dc_fsm_info *info,
+                                         int                       from_state_id,
+                                         int                       to_state_id)
+{
+    (void)env;
+    (void)err;
+    (void)from_state_id;
+    (void)to_state_id;
+    fuzz_async_count(info);
+}
+
+static void fuzz_async_did_change_state(const struct dc_env      *env,
+                                        struct dc_error          *err,
+                                        const struct dc_fsm_info *info,
+                                        int                       from_state_id,
+                                        int                       to_state_id,
+                                        int                       next_id)
+{
+    (void)env;
+    (void)err;
+    (void)from_state_id;
+    (void)to_state_id;
+    (void)next_id;
+    fuzz_async_count(info);
+}
+
+// the machines are named after the policy they run through
+static void fuzz_async_count(const struct dc_fsm_info *info)
+{
+    size_t policy;
+
+    policy = strcmp(dc_fsm_info_get_name(info), fuzz_async_names[DC_FSM_ASYNC_BLOCK]) == 0 ? DC_FSM_ASYNC_BLOCK
+                                                                                            : DC_FSM_ASYNC_DROP;
+    atomic_fetch_add_explicit(&fuzz_asyncs[policy].notified, 1, memory_order_relaxed);
+}
+
+// one slot per worker, so an attach never runs out of slots
+static void fuzz_shm_open(const struct dc_env *env, struct dc_error *err, size_t slot_count)
+{
+    sprintf(fuzz_shm_path, "/dc_fsm_fuzz_%ld", (long)getpid());    // NOLINT(cert-err33-c)
+    fuzz_shm = dc_fsm_shm_open(env, err, fuzz_shm_path, slot_count);
+    fuzz_check(fuzz_shm != NULL, "dc_fsm_shm_open");
+}
+
+// a machine that runs in a slot while the other workers attach, detach, and take snapshots
+static void fuzz_shm_run(const struct dc_env *env, struct dc_error *err, uint64_t *random)
+{
+    static const struct dc_fsm_transition transitions[] = {
+        {DC_FSM_INIT, DC_FSM_USER_START, fuzz_countdown},
+        {DC_FSM_USER_START, DC_FSM_USER_START, fuzz_countdown},
+        {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
+    };
+    struct dc_fsm_info *info;
+    uint64_t            value;
+    size_t              steps;
+    size_t              remaining;
+
+    value     = fuzz_random(random);
+    steps     = (size_t)(value >> 8U) % FUZZ_MAX_STEPS + 1;
+    remaining = steps;
+    info      = dc_fsm_info_create(env, err, fuzz_shm_names[(value >> 32U) % 3]);
+    fuzz_check(info != NULL, "dc_fsm_info_create");
+    fuzz_check(dc_fsm_info_attach_shm(env, err, info, fuzz_shm) >= 0, "dc_fsm_info_attach_shm");
+    fuzz_shm_check_snapshot(info, 0);
+    fuzz_check(dc_fsm_run(env, err, info, NULL, NULL, &remaining, transitions) == 0, "dc_fsm_run with shm");
+    fuzz_shm_check_snapshot(info, steps);
+
+    if(value & 0x10U)
+    {
+        dc_fsm_info_detach_shm(env, info);
+    }
+
+    dc_fsm_info_destroy(env, &info);
+}
+
+// the slot of info shows what it has done, and no slot shows a name that was being overwritten; names longer than a
+// slot holds are cut short
+static void fuzz_shm_check_snapshot(const struct dc_fsm_info *info, size_t steps)
+{
+    struct dc_fsm_shm_entry *entries;
+    size_t                   count;
+    size_t                   found;
+
+    entries = malloc(dc_fsm_shm_get_slot_count(fuzz_shm) * sizeof(struct dc_fsm_shm_entry));
+    fuzz_check(entries != NULL, "malloc");
+    count = dc_fsm_shm_snapshot(fuzz_shm, entries, dc_fsm_shm_get_slot_count(fuzz_shm));
+    found = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        bool known;
+
+        known = false;
+
+        for(size_t j = 0; j < sizeof(fuzz_shm_names) / sizeof(fuzz_shm_names[0]); j++)
+        {
+            known = known || strncmp(entries[i].name, fuzz_shm_names[j], DC_FSM_SHM_NAME_LENGTH - 1) == 0;
+        }
+
+        fuzz_check(known, "dc_fsm_shm_snapshot name");
+        fuzz_check(entries[i].owner == getpid(), "dc_fsm_shm_snapshot owner");
+
+        if(strncmp(entries[i].name, dc_fsm_info_get_name(info), DC_FSM_SHM_NAME_LENGTH - 1) == 0 &&
+           entries[i].transitions == steps)
+        {
+            found++;
+        }
+    }
+
+    // other workers may be running machines with the same name, so only check that the slot of info is there
+    fuzz_check(found > 0, "dc_fsm_shm_snapshot slot");
+    free(entries);
+}
+
+static void fuzz_shm_close(const struct dc_env *env, struct dc_error *err)
+{
+    struct dc_fsm_shm_entry entry;
+
+    fuzz_check(dc_fsm_shm_snapshot(fuzz_shm, &entry, 1) == 0, "dc_fsm_shm_snapshot after detach");
+    dc_fsm_shm_close(env, &fuzz_shm);
+    fuzz_check(dc_fsm_shm_unlink(env, err, fuzz_shm_path) == 0, "dc_fsm_shm_unlink");
+}
+
+#endif
+
+static void fuzz_one(const struct dc_env *env, struct dc_error *err, const uint8_t *data, size_t size)
+{
+    struct fuzz_input input;
+    uint8_t           flags;
+
+    input.data     = data;
+    input.size     = size;
+    input.position = 0;
+    flags          = fuzz_byte(&input);
+    fuzz_fsm(env, err, &input, flags);
+    fuzz_dfa(env, err, &input, flags);
+}
+
+static void fuzz_fsm(const struct dc_env *env, struct dc_error *err, struct fuzz_input *input, uint8_t flags)
+{
+    struct dc_fsm_transition  transitions[FUZZ_MAX_TRANSITIONS + 2];
+    struct dc_fsm_guard       guard_table[FUZZ_MAX_TRANSITIONS + 1];
+    struct dc_fsm_guard_stats stats[FUZZ_FUNCTION_COUNT];
+    struct fuzz_trace         expected;
+    struct fuzz_trace         actual;
+    struct fuzz_run           run;
+    struct fuzz_run           reference;
+    struct dc_fsm_info       *info;
+    size_t                    count;
+    size_t                    guard_count;
+    size_t                    evaluations;
+    size_t                    stats_count;
+    int                       expected_from_id;
+    int                       expected_to_id;
+    int                       expected_status;
+    int                       from_id;
+    int                       to_id;
+    int                       status;
+
+    memset(&run, 0, sizeof(run));
+    run.state_count      = (size_t)(fuzz_byte(input) % FUZZ_MAX_STATES) + 1;
+    run.exclusive_guards = (flags & FUZZ_EXCLUSIVE_GUARDS) != 0;
+    count                = fuzz_byte(input) % FUZZ_MAX_TRANSITIONS;
+    guard_count          = 0;
+    transitions[0]       = (struct dc_fsm_transition){
+        DC_FSM_INIT, DC_FSM_USER_START, performs[fuzz_byte(input) % FUZZ_FUNCTION_COUNT]};
+
+    // the odd unknown id, missing perform, or missing transition out of a state is the point
+    for(size_t i = 1; i <= count; i++)
+    {
+        struct dc_fsm_transition *transition;
+        uint8_t                   pick;
+
+        transition          = &transitions[i];
+        pick                = fuzz_byte(input);
+        transition->from_id = (size_t)pick % (run.state_count + 1) == run.state_count
+                                ? DC_FSM_INIT
+                                : DC_FSM_USER_START + (int)((size_t)pick % run.state_count);
+        pick                = fuzz_byte(input);
+
+        if((size_t)pick % (run.state_count + 2) < run.state_count)
+        {
+            transition->to_id = DC_FSM_USER_START + (int)((size_t)pick % (run.state_count + 2));
+        }
+        else if((size_t)pick % (run.state_count + 2) == run.state_count)
+        {
+            transition->to_id = DC_FSM_EXIT;
+        }
+        else
+        {
+            transition->to_id = FUZZ_UNKNOWN_ID + pick;
+        }
+
+        pick                = fuzz_byte(input);
+        transition->perform = pick % (FUZZ_FUNCTION_COUNT + 1) < FUZZ_FUNCTION_COUNT
+                                ? performs[pick % (FUZZ_FUNCTION_COUNT + 1)]
+                                : NULL;
+        pick                = fuzz_byte(input);
+
+        if(pick % (FUZZ_FUNCTION_COUNT + 2) < FUZZ_FUNCTION_COUNT)
+        {
+            guard_table[guard_count] = (struct dc_fsm_guard){
+                transition->from_id, transition->to_id, guards[pick % (FUZZ_FUNCTION_COUNT + 2)]};
+            guard_count++;
+        }
+    }
+
+    transitions[count + 1]   = (struct dc_fsm_transition){DC_FSM_IGNORE, DC_FSM_IGNORE, NULL};
+    guard_table[guard_count] = (struct dc_fsm_guard){DC_FSM_IGNORE, DC_FSM_IGNORE, NULL};
+    run.seed               = fuzz_hash(input->data, input->position);
+    run.choices.data       = input->data + input->position;
+    run.choices.size       = input->size - input->position;
+    run.choices.position   = 0;
+
+    reference            = run;
+    expected.hash        = FUZZ_FNV_OFFSET;
+    expected.events      = 0;
+    expected.guard_calls = 0;
+    current_trace        = &expected;
+    expected_status      = fuzz_reference_run(&reference, transitions, guard_table, &expected_from_id, &expected_to_id);
+
+    info = fuzz_info_create(env, err);
+    fuzz_check(dc_fsm_info_set_guards(env, err, info, guard_table) == 0, "dc_fsm_info_set_guards");
+    dc_fsm_info_set_guard_ordering(info, run.exclusive_guards);
+    actual.hash        = FUZZ_FNV_OFFSET;
+    actual.events      = 0;
+    actual.guard_calls = 0;
+    current_trace      = &actual;
+    status             = dc_fsm_run(env, err, info, &from_id, &to_id, &run, transitions);
+    current_trace      = NULL;
+
+    fuzz_check(status == expected_status, "dc_fsm_run status");
+    fuzz_check(status == 0 || dc_error_has_error(err), "dc_fsm_run failed without an error");
+    fuzz_check(from_id == expected_from_id && to_id == expected_to_id, "dc_fsm_run final state");
+    fuzz_check(actual.hash == expected.hash && actual.events == expected.events, "dc_fsm_run trace");
+    evaluations = 0;
+    stats_count = dc_fsm_info_get_guard_stats(info, stats, FUZZ_FUNCTION_COUNT);
+
+    for(size_t i = 0; i < stats_count && i < FUZZ_FUNCTION_COUNT; i++)
+    {
+        evaluations += stats[i].evaluations;
+    }
+
+    fuzz_check(evaluations == actual.guard_calls, "guard stats");
+
+    // with ordering on the guards can be called in any order, but no more often
+    if(!run.exclusive_guards)
+    {
+        fuzz_check(actual.guard_calls == expected.guard_calls, "guard calls");
+    }
+    else
+    {
+        fuzz_check(actual.guard_calls <= FUZZ_FUNCTION_COUNT * (run.steps + 1), "guard calls");
+    }
+
+    dc_fsm_info_destroy(env, &info);
+    dc_error_reset(err);
+    input->position += run.choices.position;
+}
+
+static void fuzz_dfa(const struct dc_env *env, struct dc_error *err, struct fuzz_input *input, uint8_t flags)
+{
+    struct fuzz_dfa       dfa;
+    struct fuzz_dfa_state state;
+    struct fuzz_trace     expected;
+    struct fuzz_trace     actual;
+    struct fuzz_run       run;
+    struct fuzz_run       reference;
+    struct dc_fsm_dfa    *machine;
+    struct dc_fsm_info   *info;
+    const uint8_t        *data;
+    uint8_t              *generated;
+    size_t                class_count;
+    size_t                count;
+    size_t                length;
+    size_t                split;
+    size_t                tail;
+    size_t                expected_consumed;
+    size_t                consumed;
+    bool                  parallel;
+    int                   expected_status;
+    int                   status;
+
+    memset(&dfa, 0, sizeof(dfa));
+    memset(&run, 0, sizeof(run));
+    parallel        = (flags & FUZZ_PARALLEL_MASK) == FUZZ_PARALLEL_MASK;
+    dfa.state_count = (size_t)(fuzz_byte(input) % FUZZ_MAX_DFA_STATES) + 1;
+    run.state_count = dfa.state_count;
+    class_count     = fuzz_byte(input) % (FUZZ_MAX_CLASSES + 1);
+
+    for(size_t i = 0; i < class_count; i++)
+    {
+        unsigned int first;
+        unsigned int last;
+
+        first = fuzz_byte(input);
+        last  = first + fuzz_byte(input) % FUZZ_MAX_CLASS_WIDTH;
+
+        if(last > UINT8_MAX)
+        {
+            last = UINT8_MAX;
+        }
+
+        dfa.classes[i] = (struct dc_fsm_dfa_class){
+            (unsigned char)first, (unsigned char)last, (int)(fuzz_byte(input) % FUZZ_MAX_CLASSES) + 1};
+
+        for(unsigned int c = first; c <= last; c++)
+        {
+            dfa.class_map[c] = dfa.classes[i].class_id;
+        }
+    }
+
+    dfa.classes[class_count] = (struct dc_fsm_dfa_class){0, 0, DC_FSM_IGNORE};
+    count                    = 0;
+
+    // a parallel run needs long stretches without actions or missing transitions to be worth splitting, so there
+    // every transition is declared and only the declared classes, which the generated data rarely uses, have actions
+    for(size_t from = 0; from < dfa.state_count; from++)
+    {
+        for(int class_id = DC_FSM_DFA_CLASS_OTHER; class_id <= FUZZ_MAX_CLASSES; class_id++)
+        {
+            struct dc_fsm_dfa_transition *transition;
+            uint8_t                       to;
+            uint8_t                       pick;
+
+            pick = fuzz_byte(input);
+
+            if(!parallel && pick % 4 == 0)
+            {
+                continue;
+            }
+
+            to                    = fuzz_byte(input);
+            transition            = &dfa.transitions[count++];
+            transition->from_id   = DC_FSM_USER_START + (int)from;
+            transition->class_id  = class_id;
+            transition->to_id     = (size_t)to % (dfa.state_count + 1) == dfa.state_count
+                                      ? DC_FSM_EXIT
+                                      : DC_FSM_USER_START + (int)((size_t)to % (dfa.state_count + 1));
+            transition->perform   = NULL;
+
+            if(parallel ? class_id != DC_FSM_DFA_CLASS_OTHER && pick % 4 == 1 : pick % 8 == 1)
+            {
+                transition->perform = actions[(pick >> 7U) & 1U];
+            }
+
+            if(parallel && transition->to_id == DC_FSM_EXIT && transition->perform == NULL)
+            {
+                transition->to_id = transition->from_id;
+            }
+        }
+    }
+
+    dfa.transitions[count] = (struct dc_fsm_dfa_transition){DC_FSM_IGNORE, 0, 0, NULL};
+
+    // the first declaration of a state and class wins
+    for(size_t i = count; i > 0; i--)
+    {
+        const struct dc_fsm_dfa_transition *transition;
+        int                                 from;
+
+        transition                             = &dfa.transitions[i - 1];
+        from                                   = fuzz_dfa_index(&dfa, transition->from_id);
+        dfa.lookup[from][transition->class_id] = transition;
+    }
+
+    machine = dc_fsm_dfa_create(env, err, dfa.classes, dfa.transitions);
+    fuzz_check(machine != NULL, "dc_fsm_dfa_create");
+    split     = fuzz_byte(input);
+    generated = NULL;
+
+    if(parallel)
+    {
+        uint8_t  others[UINT8_MAX + 1];
+        size_t   other_count;
+        uint64_t random;
+
+        generated = malloc(FUZZ_PARALLEL_LENGTH);
+        fuzz_check(generated != NULL, "malloc");
+        random      = fuzz_hash(input->data, input->size) | 1U;
+        other_count = 0;
+
+        for(unsigned int c = 0; c <= UINT8_MAX; c++)
+        {
+            if(dfa.class_map[c] == DC_FSM_DFA_CLASS_OTHER)
+            {
+                others[other_count++] = (uint8_t)c;
+            }
+        }
+
+        for(size_t i = 0; i < FUZZ_PARALLEL_LENGTH; i++)
+        {
+            uint64_t value;
+
+            value = fuzz_random(&random);
+
+            if(other_count > 0 && value % FUZZ_RARE_BYTE_ODDS != 0)
+            {
+                generated[i] = others[(value >> 16U) % other_count];
+            }
+            else
+            {
+                generated[i] = (uint8_t)(value >> 8U);
+            }
+        }
+
+        data   = generated;
+        length = FUZZ_PARALLEL_LENGTH;
+    }
+    else
+    {
+        data   = input->data + input->position;
+        length = input->size - input->position;
+    }
+
+    split                = split < length ? split : length;
+    tail                 = split < FUZZ_TAIL_LENGTH ? split : FUZZ_TAIL_LENGTH;
+    run.seed             = fuzz_hash(input->data, input->position);
+    run.choices.data     = input->data;
+    run.choices.size     = input->size;
+    run.choices.position = 0;
+
+    // one buffer at a time, so the state carried between calls is checked too
+    reference            = run;
+    expected.hash        = FUZZ_FNV_OFFSET;
+    expected.events      = 0;
+    expected.guard_calls = 0;
+    current_trace        = &expected;
+    state.from_id        = DC_FSM_INIT;
+    state.current_id     = DC_FSM_USER_START;
+    expected_status      = fuzz_reference_scan(&reference, &dfa, &state, data, split, &expected_consumed);
+    fuzz_record('S', expected_status, 0, expected_consumed);
+    expected_status = fuzz_reference_scan(&reference, &dfa, &state, data + split, length - split, &expected_consumed);
+    fuzz_record('S', expected_status, 0, expected_consumed);
+
+    info               = fuzz_info_create(env, err);
+    actual.hash        = FUZZ_FNV_OFFSET;
+    actual.events      = 0;
+    actual.guard_calls = 0;
+    current_trace      = &actual;
+    status             = dc_fsm_dfa_run(env, err, info, machine, data, split, &consumed, &run);
+    fuzz_record('S', status, 0, consumed);
+    fuzz_check(status == 0 || dc_error_has_error(err), "dc_fsm_dfa_run failed without an error");
+    dc_error_reset(err);
+    status = dc_fsm_dfa_run(env, err, info, machine, data + split, length - split, &consumed, &run);
+    fuzz_record('S', status, 0, consumed);
+    current_trace = NULL;
+    fuzz_check(status == 0 || dc_error_has_error(err), "dc_fsm_dfa_run failed without an error");
+    fuzz_check(actual.hash == expected.hash && actual.events == expected.events, "dc_fsm_dfa_run trace");
+    dc_fsm_info_destroy(env, &info);
+    dc_error_reset(err);
+
+    // the whole buffer split across threads, then a short tail to check the state it ended in
+    run.choices.position = 0;
+    run.steps            = 0;
+    reference            = run;
+    expected.hash        = FUZZ_FNV_OFFSET;
+    expected.events      = 0;
+    current_trace        = &expected;
+    state.from_id        = DC_FSM_INIT;
+    state.current_id     = DC_FSM_USER_START;
+    expected_status      = fuzz_reference_scan(&reference, &dfa, &state, data, length, &expected_consumed);
+    fuzz_record('S', expected_status, 0, expected_consumed);
+    expected_status = fuzz_reference_scan(&reference, &dfa, &state, data, tail, &expected_consumed);
+    fuzz_record('S', expected_status, 0, expected_consumed);
+
+    info          = fuzz_info_create(env, err);
+    actual.hash   = FUZZ_FNV_OFFSET;
+    actual.events = 0;
+    current_trace = &actual;
+    status        = dc_fsm_dfa_run_parallel(
+        env, err, info, machine, data, length, FUZZ_PARALLEL_THREADS, &consumed, &run);
+    fuzz_record('S', status, 0, consumed);
+    dc_error_reset(err);
+    status = dc_fsm_dfa_run(env, err, info, machine, data, tail, &consumed, &run);
+    fuzz_record('S', status, 0, consumed);
+    current_trace = NULL;
+    fuzz_check(actual.hash == expected.hash && actual.events == expected.events, "dc_fsm_dfa_run_parallel trace");
+    dc_fsm_info_destroy(env, &info);
+    dc_error_reset(err);
+    dc_fsm_dfa_destroy(env, &machine);
+    free(generated);
+}
+
+static int fuzz_reference_run(struct fuzz_run                *run,
+                              const struct dc_fsm_transition  transitions[],
+                              const struct dc_fsm_guard       guard_table[],
+                              int                            *pfrom_id,
+                              int                            *pto_id)
+{
+    int from_id;
+    int to_id;
+
+    from_id = DC_FSM_INIT;
+    to_id   = DC_FSM_USER_START;
+
+    do
+    {
+        const struct dc_fsm_transition *transition;
+        int                             next_id;
+
+        fuzz_record('W', from_id, to_id, 0);
+        transition = transitions;
+
+        while(transition->from_id != DC_FSM_IGNORE && (transition->from_id != from_id || transition->to_id != to_id))
+        {
+            transition++;
+        }
+
+        if(transition->from_id == DC_FSM_IGNORE || transition->perform == NULL)
+        {
+            fuzz_record('B', from_id, to_id, 0);
+            *pfrom_id = from_id;
+            *pto_id   = to_id;
+
+            return -1;
+        }
+
+        next_id = transition->perform(NULL, NULL, run);
+
+        if(next_id == DC_FSM_ROUTE)
+        {
+            next_id = fuzz_reference_route(run, transitions, guard_table, to_id);
+        }
+
+        fuzz_record('D', from_id, to_id, (size_t)(unsigned int)next_id);
+        from_id = to_id;
+        to_id   = next_id;
+    } while(to_id != DC_FSM_EXIT);
+
+    *pfrom_id = from_id;
+    *pto_id   = to_id;
+
+    return 0;
+}
+
+static int fuzz_reference_route(struct fuzz_run                *run,
+                                const struct dc_fsm_transition  transitions[],
+                                const struct dc_fsm_guard       guard_table[],
+                                int                             from_id)
+{
+    bool evaluated[FUZZ_FUNCTION_COUNT];
+    bool passed[FUZZ_FUNCTION_COUNT];
+
+    memset(evaluated, 0, sizeof(evaluated));
+
+    for(const struct dc_fsm_guard *guard = guard_table; guard->from_id != DC_FSM_IGNORE; guard++)
+    {
+        size_t index;
+
+        if(guard->from_id != from_id)
+        {
+            continue;
+        }
+
+        for(index = 0; guards[index] != guard->guard; index++)
+        {
+        }
+
+        if(!evaluated[index])
+        {
+            passed[index]    = guard->guard(NULL, NULL, run);
+            evaluated[index] = true;
+        }
+
+        if(passed[index])
+        {
+            return guard->to_id;
+        }
+    }
+
+    // the first transition out of from_id that has no guard
+    for(const struct dc_fsm_transition *transition = transitions; transition->from_id != DC_FSM_IGNORE; transition++)
+    {
+        const struct dc_fsm_guard *guard;
+
+        if(transition->from_id != from_id)
+        {
+            continue;
+        }
+
+        for(guard = guard_table; guard->from_id != DC_FSM_IGNORE; guard++)
+        {
+            if(guard->from_id == from_id && guard->to_id == transition->to_id)
+            {
+                break;
+            }
+        }
+
+        if(guard->from_id == DC_FSM_IGNORE)
+        {
+            return transition->to_id;
+        }
+    }
+
+    return DC_FSM_ROUTE;
+}
+
+static int fuzz_reference_scan(struct fuzz_run       *run,
+                               const struct fuzz_dfa *dfa,
+                               struct fuzz_dfa_state *state,
+                               const uint8_t         *data,
+                               size_t                 length,
+                               size_t                *consumed)
+{
+    *consumed = 0;
+
+    if(fuzz_dfa_index(dfa, state->current_id) < 0)
+    {
+        fuzz_record('B', state->from_id, state->current_id, 0);
+
+        return -1;
+    }
+
+    for(size_t offset = 0; offset < length; offset++)
+    {
+        const struct dc_fsm_dfa_transition *transition;
+        int                                 next_id;
+
+        *consumed  = offset;
+        transition = dfa->lookup[fuzz_dfa_index(dfa, state->current_id)][dfa->class_map[data[offset]]];
+
+        if(transition == NULL)
+        {
+            fuzz_record('B', state->current_id, DC_FSM_IGNORE, 0);
+
+            return -1;
+        }
+
+        if(transition->perform == NULL && transition->to_id != DC_FSM_EXIT)
+        {
+            state->current_id = transition->to_id;
+            continue;
+        }
+
+        fuzz_record('W', state->current_id, transition->to_id, 0);
+        state->from_id    = state->current_id;
+        state->current_id = transition->to_id;
+        next_id           = transition->to_id;
+
+        if(transition->perform)
+        {
+            struct dc_fsm_dfa_event event;
+
+            event.data    = data;
+            event.length  = length;
+            event.offset  = offset;
+            event.from_id = state->from_id;
+            event.to_id   = transition->to_id;
+            event.arg     = run;
+            next_id       = transition->perform(NULL, NULL, &event);
+
+            if(next_id == DC_FSM_IGNORE)
+            {
+                next_id = transition->to_id;
+            }
+        }
+
+        fuzz_record('D', state->from_id, transition->to_id, (size_t)(unsigned int)next_id);
+
+        if(next_id == DC_FSM_EXIT)
+        {
+            state->current_id = DC_FSM_EXIT;
+            *consumed         = offset + 1;
+
+            return 0;
+        }
+
+        if(fuzz_dfa_index(dfa, next_id) < 0)
+        {
+            fuzz_record('B', transition->to_id, next_id, 0);
+
+            return -1;
+        }
+
+        state->current_id = next_id;
+    }
+
+    *consumed = length;
+
+    return 0;
+}
+
+static int fuzz_dfa_index(const struct fuzz_dfa *dfa, int state_id)
+{
+    if(state_id == DC_FSM_EXIT)
+    {
+        // EXIT is only a state of the machine if some transition goes there
+        for(const struct dc_fsm_dfa_transition *transition = dfa->transitions; transition->from_id != DC_FSM_IGNORE;
+            transition++)
+        {
+            if(transition->to_id == DC_FSM_EXIT)
+            {
+                return (int)dfa->state_count;
+            }
+        }
+
+        return -1;
+    }
+
+    if(state_id < DC_FSM_USER_START || state_id >= DC_FSM_USER_START + (int)dfa->state_count)
+    {
+        return -1;
+    }
+
+    // a state nothing comes from or goes to is not part of the machine
+    for(const struct dc_fsm_dfa_transition *transition = dfa->transitions; transition->from_id != DC_FSM_IGNORE;
+            transition++)
+    {
+        if(transition->from_id == state_id || transition->to_id == state_id)
+        {
+            return state_id - DC_FSM_USER_START;
+        }
+    }
+
+    return -1;
+}
+
+static int fuzz_choose_state(struct fuzz_run *run)
+{
+    uint8_t pick;
+
+    if(++run->steps >= FUZZ_MAX_STEPS)
+    {
+        return DC_FSM_EXIT;
+    }
+
+    pick = fuzz_byte(&run->choices);
+
+    if((size_t)pick % (run->state_count + 4) < run->state_count)
+    {
+        return DC_FSM_USER_START + (int)((size_t)pick % (run->state_count + 4));
+    }
+
+    switch((size_t)pick % (run->state_count + 4) - run->state_count)
+    {
+        case 0:
+        {
+            return DC_FSM_EXIT;
+        }
+        case 1:
+        case 2:
+        {
+            return DC_FSM_ROUTE;
+        }
+        default:
+        {
+            return FUZZ_UNKNOWN_ID + pick;
+        }
+    }
+}
+
+static int fuzz_choose_action(struct fuzz_run *run)
+{
+    uint8_t pick;
+
+    pick = fuzz_byte(&run->choices);
+
+    if((size_t)pick % (run->state_count + 6) < run->state_count)
+    {
+        return DC_FSM_USER_START + (int)((size_t)pick % (run->state_count + 6));
+    }
+
+    switch((size_t)pick % (run->state_count + 6) - run->state_count)
+    {
+        case 4:
+        {
+            return DC_FSM_EXIT;
+        }
+        case 5:
+        {
+            return FUZZ_UNKNOWN_ID + pick;
+        }
+        default:
+        {
+            return DC_FSM_IGNORE;
+        }
+    }
+}
+
+static bool fuzz_guard(void *arg, size_t index)
+{
+    struct fuzz_run *run;
+    uint64_t         value;
+
+    run = arg;
+    current_trace->guard_calls++;
+
+    // the same for every call in a step, so memoising a guard cannot change the result
+    if(run->exclusive_guards)
+    {
+        value = fuzz_mix(run->seed ^ run->steps);
+
+        return value % (FUZZ_FUNCTION_COUNT + 1) == index;
+    }
+
+    value = fuzz_mix(run->seed ^ (run->steps << 8U) ^ index);
+
+    return (value & 3U) == 0;
+}
+
+static int fuzz_perform(void *arg, size_t index)
+{
+    struct fuzz_run *run;
+    int              next_id;
+
+    run     = arg;
+    next_id = fuzz_choose_state(run);
+    fuzz_record('P', (int)index, next_id, run->steps);
+
+    return next_id;
+}
+
+static int fuzz_action(void *arg, size_t index)
+{
+    struct dc_fsm_dfa_event *event;
+    int                      next_id;
+
+    event   = arg;
+    next_id = fuzz_choose_action(event->arg);
+    fuzz_record('A', (int)index, next_id, event->offset);
+
+    return next_id;
+}
+
+static int fuzz_perform_0(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_perform(arg, 0);
+}
+
+static int fuzz_perform_1(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_perform(arg, 1);
+}
+
+static int fuzz_perform_2(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_perform(arg, 2);
+}
+
+static int fuzz_perform_3(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_perform(arg, 3);
+}
+
+static bool fuzz_guard_0(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_guard(arg, 0);
+}
+
+static bool fuzz_guard_1(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_guard(arg, 1);
+}
+
+static bool fuzz_guard_2(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_guard(arg, 2);
+}
+
+static bool fuzz_guard_3(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_guard(arg, 3);
+}
+
+static int fuzz_action_0(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_action(arg, 0);
+}
+
+static int fuzz_action_1(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    (void)env;
+    (void)err;
+
+    return fuzz_action(arg, 1);
+}
+
+static void fuzz_will_change_state(const struct dc_env      *env,
+                                   struct dc_error          *err,
+                                   const struct dc_fsm_info *info,
+                                   int                       from_state_id,
+                                   int                       to_state_id)
+{
+    (void)env;
+    (void)err;
+    (void)info;
+    fuzz_record('W', from_state_id, to_state_id, 0);
+}
+
+static void fuzz_did_change_state(const struct dc_env      *env,
+                                  struct dc_error          *err,
+                                  const struct dc_fsm_info *info,
+                                  int                       from_state_id,
+                                  int                       to_state_id,
+                                  int                       next_id)
+{
+    (void)env;
+    (void)err;
+    (void)info;
+    fuzz_record('D', from_state_id, to_state_id, (size_t)(unsigned int)next_id);
+}
+
+static void fuzz_bad_change_state(const struct dc_env      *env,
+                                  struct dc_error          *err,
+                                  const struct dc_fsm_info *info,
+                                  int                       from_state_id,
+                                  int                       to_state_id)
+{
+    (void)env;
+    (void)err;
+    (void)info;
+    fuzz_record('B', from_state_id, to_state_id, 0);
+}
+
+static struct dc_fsm_info *fuzz_info_create(const struct dc_env *env, struct dc_error *err)
+{
+    struct dc_fsm_info *info;
+
+    info = dc_fsm_info_create(env, err, "fuzz");
+    fuzz_check(info != NULL, "dc_fsm_info_create");
+    dc_fsm_info_set_will_change_state(info, fuzz_will_change_state);
+    dc_fsm_info_set_did_change_state(info, fuzz_did_change_state);
+    dc_fsm_info_set_bad_change_state(info, fuzz_bad_change_state);
+
+    return info;
+}
+
+static void fuzz_record(char kind, int first, int second, size_t third)
+{
+    uint64_t values[4];
+
+    values[0] = (uint64_t)(unsigned char)kind;
+    values[1] = (uint64_t)(unsigned int)first;
+    values[2] = (uint64_t)(unsigned int)second;
+    values[3] = (uint64_t)third;
+
+    for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        current_trace->hash = (current_trace->hash ^ values[i]) * FUZZ_FNV_PRIME;
+    }
+
+    current_trace->events++;
+}
+
+static void fuzz_check(bool condition, const char *what)
+{
+    if(!condition)
+    {
+        // abort so libFuzzer and AFL keep the input
+        fprintf(stderr, "Mismatch: %s\n", what);
+        abort();
+    }
+}
+
+static uint8_t fuzz_byte(struct fuzz_input *input)
+{
+    if(input->position >= input->size)
+    {
+        return 0;
+    }
+
+    return input->data[input->position++];
+}
+
+static uint64_t fuzz_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash;
+
+    hash = FUZZ_FNV_OFFSET;
+
+    for(size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * FUZZ_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint64_t fuzz_mix(uint64_t value)
+{
+    value ^= value >> 30U;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27U;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31U;
+
+    return value;
+}
+
+static uint64_t fuzz_random(uint64_t *state)
+{
+    *state ^= *state >> 12U;
+    *state ^= *state << 25U;
+    *state ^= *state >> 27U;
+
+    return *state * 0x2545f4914f6cdd1dULL;
+}
@@ -8,6 +8,8 @@ int main(int argc, char **argv)
     int suite_result;
 
     suite = create_test_suite();
+    add_suite(suite, async_tests());
+    add_suite(suite, shm_tests());
     reporter = create_text_reporter();
 
     if(argc > 1)
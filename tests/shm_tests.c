@@ -0,0 +1,192 @@
+/*
+ * Copyright 2021-2021 D'Arcy Smith.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tests.h"
+#include <dc_env/env.h>
+#include <dc_error/error.h>
+#include <dc_fsm/fsm.h>
+#include <dc_fsm/shm.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define SHM_TEST_PATH "/dc_fsm_shm_test"
+#define SHM_TEST_SLOTS 4
+#define SHM_TEST_STEPS 10
+
+enum shm_test_states
+{
+    PING = DC_FSM_USER_START,    // 2
+    PONG,                        // 3
+};
+
+static int shm_test_ping(const struct dc_env *env, struct dc_error *err, void *arg);
+static int shm_test_pong(const struct dc_env *env, struct dc_error *err, void *arg);
+
+static struct dc_error *test_err;
+static struct dc_env   *test_env;
+
+Describe(shm);
+
+BeforeEach(shm)
+{
+    test_err = dc_error_create(false);
+    test_env = dc_env_create(test_err, false, NULL);
+    dc_fsm_shm_unlink(test_env, test_err, SHM_TEST_PATH);
+    dc_error_reset(test_err);
+}
+
+AfterEach(shm)
+{
+    dc_fsm_shm_unlink(test_env, test_err, SHM_TEST_PATH);
+    dc_error_reset(test_err);
+    free(test_env);
+    free(test_err);
+}
+
+Ensure(shm, attach_snapshot_and_adopt_a_dead_slot)
+{
+    static const struct dc_fsm_transition transitions[] = {
+        {DC_FSM_INIT, PING, shm_test_ping},
+        {PING, PONG, shm_test_pong},
+        {PONG, PING, shm_test_ping},
+        {DC_FSM_IGNORE, DC_FSM_IGNORE, NULL},
+    };
+    struct dc_fsm_shm_entry entries[SHM_TEST_SLOTS];
+    struct dc_fsm_shm      *shm;
+    struct dc_fsm_info     *parent;
+    struct dc_fsm_info     *adopter;
+    pid_t                   pid;
+    int                     status;
+    size_t                  count;
+
+    shm = dc_fsm_shm_open(test_env, test_err, SHM_TEST_PATH, SHM_TEST_SLOTS);
+    assert_that(shm, is_not_null);
+    assert_that(dc_fsm_shm_get_slot_count(shm), is_equal_to(SHM_TEST_SLOTS));
+
+    parent = dc_fsm_info_create(test_env, test_err, "parent");
+    assert_that(dc_fsm_info_attach_shm(test_env, test_err, parent, shm), is_equal_to(0));
+
+    count = dc_fsm_shm_snapshot(shm, entries, SHM_TEST_SLOTS);
+    assert_that(count, is_equal_to(1));
+    assert_that(entries[0].slot, is_equal_to(0));
+    assert_that(entries[0].owner, is_equal_to(getpid()));
+    assert_that(entries[0].transitions, is_equal_to(0));
+    assert_that(entries[0].name, is_equal_to_string("parent"));
+
+    pid = fork();
+    assert_that(pid, is_not_equal_to(-1));
+
+    if(pid == 0)
+    {
+        struct dc_fsm_shm  *child_shm;
+        struct dc_fsm_info *child;
+        int                 from_state_id;
+        int                 to_state_id;
+        int                 counter;
+
+        // the child maps the segment on its own and exits without detaching, as a crashed process would
+        child_shm = dc_fsm_shm_open(test_env, test_err, SHM_TEST_PATH, 0);
+        child     = dc_fsm_info_create(test_env, test_err, "child");
+
+        if(child_shm == NULL || child == NULL || dc_fsm_info_attach_shm(test_env, test_err, child, child_shm) != 1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        counter = SHM_TEST_STEPS;
+
+        if(dc_fsm_run(test_env, test_err, child, &from_state_id, &to_state_id, &counter, transitions) != 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    assert_that(waitpid(pid, &status, 0), is_equal_to(pid));
+    assert_that(WIFEXITED(status), is_true);
+    assert_that(WEXITSTATUS(status), is_equal_to(EXIT_SUCCESS));
+
+    count = dc_fsm_shm_snapshot(shm, entries, SHM_TEST_SLOTS);
+    assert_that(count, is_equal_to(2));
+    assert_that(entries[1].slot, is_equal_to(1));
+    assert_that(entries[1].owner, is_equal_to(pid));
+    assert_that(entries[1].transitions, is_equal_to(SHM_TEST_STEPS));
+    assert_that(entries[1].name, is_equal_to_string("child"));
+
+    // the parent is still running, so its slot cannot be taken
+    adopter = dc_fsm_info_create(test_env, test_err, "adopter");
+    assert_that(dc_fsm_info_adopt_shm(test_env, test_err, adopter, shm, 0), is_equal_to(-1));
+    assert_that(dc_error_has_error(test_err), is_true);
+    dc_error_reset(test_err);
+
+    assert_that(dc_fsm_info_adopt_shm(test_env, test_err, adopter, shm, 1), is_equal_to(0));
+    count = dc_fsm_shm_snapshot(shm, entries, SHM_TEST_SLOTS);
+    assert_that(count, is_equal_to(2));
+    assert_that(entries[1].owner, is_equal_to(getpid()));
+    assert_that(entries[1].transitions, is_equal_to(SHM_TEST_STEPS));
+    assert_that(entries[1].name, is_equal_to_string("adopter"));
+
+    // destroying a machine detaches it and frees its slot
+    dc_fsm_info_destroy(test_env, &adopter);
+    dc_fsm_info_detach_shm(test_env, parent);
+    assert_that(dc_fsm_shm_snapshot(shm, entries, SHM_TEST_SLOTS), is_equal_to(0));
+    assert_that(dc_fsm_info_attach_shm(test_env, test_err, parent, shm), is_equal_to(0));
+    count = dc_fsm_shm_snapshot(shm, entries, SHM_TEST_SLOTS);
+    assert_that(count, is_equal_to(1));
+    assert_that(entries[0].owner, is_equal_to(getpid()));
+    assert_that(entries[0].name, is_equal_to_string("parent"));
+
+    dc_fsm_info_destroy(test_env, &parent);
+    dc_fsm_shm_close(test_env, &shm);
+}
+
+TestSuite *shm_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, shm, attach_snapshot_and_adopt_a_dead_slot);
+
+    return suite;
+}
+
+static int shm_test_ping(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    int *counter;
+
+    DC_TRACE(env);
+    (void)err;
+    counter = arg;
+    (*counter)--;
+
+    return *counter > 0 ? PONG : DC_FSM_EXIT;
+}
+
+static int shm_test_pong(const struct dc_env *env, struct dc_error *err, void *arg)
+{
+    int *counter;
+
+    DC_TRACE(env);
+    (void)err;
+    counter = arg;
+    (*counter)--;
+
+    return *counter > 0 ? PING : DC_FSM_EXIT;
+}
@@ -5,4 +5,8 @@
 #include <cgreen/cgreen.h>
 
 
+TestSuite *async_tests(void);
+TestSuite *shm_tests(void);
+
+
 #endif // LIBDC_POSIX_TESTS_H